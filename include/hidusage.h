@@ -0,0 +1,27 @@
+/*********************************************************************
+ * hidusage.h - Usages of the consumer and system control keys, for  *
+ * the fn_keys tables of the keymaps.                                *
+ *********************************************************************/
+#ifndef HIDUSAGE_H
+#define HIDUSAGE_H
+
+/* Matrix position of a key, as used in fn_keys */
+#define FNPOS(row,col) ((row)*8+(col))
+
+/* Usages on the consumer page (0x0C). A usage on the generic desktop
+   page (0x01), i.e. a system control key, is marked with SYSTEM_CTRL. */
+#define SYSTEM_CTRL    0x8000
+
+#define CC_NEXT        0x00B5 /* Scan Next Track */
+#define CC_PREV        0x00B6 /* Scan Previous Track */
+#define CC_STOP        0x00B7 /* Stop */
+#define CC_PLAY        0x00CD /* Play/Pause */
+#define CC_MUTE        0x00E2 /* Mute */
+#define CC_VOLUP       0x00E9 /* Volume Increment */
+#define CC_VOLDOWN     0x00EA /* Volume Decrement */
+
+#define SC_POWER       (SYSTEM_CTRL|0x81) /* System Power Down */
+#define SC_SLEEP       (SYSTEM_CTRL|0x82) /* System Sleep */
+#define SC_WAKE        (SYSTEM_CTRL|0x83) /* System Wake Up */
+
+#endif
@@ -0,0 +1,181 @@
+/*********************************************************************
+ * keycodes.h - Keycodes of the keymaps, shared by all of them.      *
+ *********************************************************************/
+#ifndef KEYCODES_H
+#define KEYCODES_H
+
+/* The USB keycodes are enumerated here - the first part is simply
+   an enumeration of the allowed scan-codes used for USB HID devices.
+   All keymaps share this enumeration, so several of them can be built
+   into one firmware. */
+enum keycodes {
+  KEY__=0,
+  KEY_errorRollOver,
+  KEY_POSTfail,
+  KEY_errorUndefined,
+  KEY_A,        // 4
+  KEY_B,
+  KEY_C,
+  KEY_D,
+  KEY_E,
+  KEY_F,
+  KEY_G, 
+  KEY_H,
+  KEY_I,
+  KEY_J,
+  KEY_K,
+  KEY_L,
+  KEY_M,        // 0x10
+  KEY_N,
+  KEY_O,
+  KEY_P,
+  KEY_Q, 
+  KEY_R,
+  KEY_S,
+  KEY_T,
+  KEY_U,
+  KEY_V,
+  KEY_W,
+  KEY_X,
+  KEY_Y,
+  KEY_Z,
+  KEY_1,
+  KEY_2,
+  KEY_3,        // 0x20
+  KEY_4,
+  KEY_5,
+  KEY_6,
+  KEY_7,
+  KEY_8,
+  KEY_9,
+  KEY_0,        // 0x27
+  KEY_enter,
+  KEY_esc,
+  KEY_bckspc,   // backspace
+  KEY_tab,
+  KEY_spc,      // space
+  KEY_minus,    // - (and _)
+  KEY_equal,    // = (and +)
+  KEY_lbr,      // [
+  KEY_rbr,      // ]  -- 0x30
+  KEY_bckslsh,  // \ (and |)
+  KEY_hash,     // Non-US # and ~
+  KEY_smcol,    // ; (and :)
+  KEY_ping,     // ' and "
+  KEY_grave,    // Grave accent and tilde
+  KEY_comma,    // , (and <)
+  KEY_dot,      // . (and >)
+  KEY_slash,    // / (and ?)
+  KEY_cpslck,   // capslock
+  KEY_F1,
+  KEY_F2,
+  KEY_F3,
+  KEY_F4,
+  KEY_F5,
+  KEY_F6, 
+  KEY_F7,       // 0x40
+  KEY_F8,
+  KEY_F9,
+  KEY_F10,
+  KEY_F11,
+  KEY_F12,
+  KEY_PrtScr,
+  KEY_scrlck,
+  KEY_break,
+  KEY_ins,
+  KEY_home,
+  KEY_pgup,
+  KEY_del,
+  KEY_end,
+  KEY_pgdn,
+  KEY_rarr, 
+  KEY_larr,     // 0x50
+  KEY_darr,
+  KEY_uarr,
+  KEY_numlock,
+  KEY_KPslash,
+  KEY_KPast,
+  KEY_KPminus,
+  KEY_KPplus,
+  KEY_KPenter,
+  KEY_KP1,
+  KEY_KP2,
+  KEY_KP3,
+  KEY_KP4,
+  KEY_KP5,
+  KEY_KP6,
+  KEY_KP7,
+  KEY_KP8,      // 0x60
+  KEY_KP9,
+  KEY_KP0,
+  KEY_KPcomma,
+  KEY_Euro2,
+
+  /* These are NOT standard USB HID - handled specially in decoding,
+     so they will be mapped to the modifier byte in the USB report */
+  KEY_Modifiers,
+  MOD_LCTRL,    // 0x01
+  MOD_LSHIFT,   // 0x02
+  MOD_LALT,     // 0x04
+  MOD_LGUI,     // 0x08
+  MOD_RCTRL,    // 0x10
+  MOD_RSHIFT,   // 0x20
+  MOD_RALT,     // 0x40
+  MOD_RGUI,     // 0x80
+  
+  /* Other keys that need special handling -
+     These name the special keys of the layouts of tools/keymapc, which
+     do not generate the same scan-code in the shifted and unshifted
+     state, and some may need to alter the shift-state to generate the
+     correct character code on the PC. keymapc resolves them into the
+     two planes of the keymap, so they never reach the firmware. */
+  KEY_Special,
+  SPC_del,
+  SPC_crsrud,
+  SPC_crsrlr,
+  SPC_F1F5,
+  SPC_F2F6,
+  SPC_F3F7,
+  SPC_F4F8,
+  SPC_2,
+  SPC_3,
+  SPC_grave,
+  SPC_quote,
+  SPC_pipe,
+  SPC_F1,
+  SPC_F2,
+  SPC_F3,
+  SPC_HELP,
+  SPC_CLR,
+  SPC_4,
+  SPC_7,
+  SPC_0,
+  SPC_plus,
+  SPC_minus,
+  SPC_pound,
+  SPC_home,
+  SPC_ast,
+  SPC_equal,
+  SPC_comma,
+  SPC_dot,
+  SPC_slash,
+  SPC_F5,
+  SPC_F7,
+  SPC_6,
+  SPC_8,
+  SPC_9,
+  SPC_hat,
+  SPC_colon,
+  SPC_smcol,
+  SPC_up,
+  SPC_down,
+  SPC_left,
+  SPC_right,
+  SPC_crsru,
+  SPC_crsrd,
+  SPC_crsrl,
+  SPC_crsrr,
+  SPC_at
+};
+
+#endif
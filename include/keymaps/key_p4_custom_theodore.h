@@ -1,6 +1,7 @@
 /*********************************************************************
- * key_dk_us.h - Keyboard mapping American C64 keyboard to American  *
- * keyboard setting on the PC side.                                  *
+ * key_p4_custom_theodore.h - Keyboard mapping American C64 keyboard *
+ * to American keyboard setting on the PC side.                      *
+ * Generated by tools/keymapc from tools/keymapc/p4_custom_theodore.kmap*
  *********************************************************************
  * Spaceman Spiff's Commodire 64 USB Keyboard (c64key for short) is  *
  * is free software; you can redistribute it and/or modify it under  *
@@ -11,189 +12,58 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
  * OBDEV license for further details.                                *
  *********************************************************************/
-#ifndef KEYMAP_H
-#define KEYMAP_H
+#ifndef KEY_P4_CUSTOM_THEODORE_H
+#define KEY_P4_CUSTOM_THEODORE_H
 #include <avr/pgmspace.h>
+#include "hidusage.h"
+#include "keycodes.h"
 
 #define PLUS4
 
 /* Number of rows in keyboard matrix */
 #define NUMROWS 9
 
-/* The USB keycodes are enumerated here - the first part is simply
-   an enumeration of the allowed scan-codes used for USB HID devices */
-enum keycodes {
-  KEY__=0,
-  KEY_errorRollOver,
-  KEY_POSTfail,
-  KEY_errorUndefined,
-  KEY_A,        // 4
-  KEY_B,
-  KEY_C,
-  KEY_D,
-  KEY_E,
-  KEY_F,
-  KEY_G, 
-  KEY_H,
-  KEY_I,
-  KEY_J,
-  KEY_K,
-  KEY_L,
-  KEY_M,        // 0x10
-  KEY_N,
-  KEY_O,
-  KEY_P,
-  KEY_Q, 
-  KEY_R,
-  KEY_S,
-  KEY_T,
-  KEY_U,
-  KEY_V,
-  KEY_W,
-  KEY_X,
-  KEY_Y,
-  KEY_Z,
-  KEY_1,
-  KEY_2,
-  KEY_3,        // 0x20
-  KEY_4,
-  KEY_5,
-  KEY_6,
-  KEY_7,
-  KEY_8,
-  KEY_9,
-  KEY_0,        // 0x27
-  KEY_enter,
-  KEY_esc,
-  KEY_bckspc,   // backspace
-  KEY_tab,
-  KEY_spc,      // space
-  KEY_minus,    // - (and _)
-  KEY_equal,    // = (and +)
-  KEY_lbr,      // [
-  KEY_rbr,      // ]  -- 0x30
-  KEY_bckslsh,  // \ (and |)
-  KEY_hash,     // Non-US # and ~
-  KEY_smcol,    // ; (and :)
-  KEY_ping,     // ' and "
-  KEY_grave,    // Grave accent and tilde
-  KEY_comma,    // , (and <)
-  KEY_dot,      // . (and >)
-  KEY_slash,    // / (and ?)
-  KEY_cpslck,   // capslock
-  KEY_F1,
-  KEY_F2,
-  KEY_F3,
-  KEY_F4,
-  KEY_F5,
-  KEY_F6, 
-  KEY_F7,       // 0x40
-  KEY_F8,
-  KEY_F9,
-  KEY_F10,
-  KEY_F11,
-  KEY_F12,
-  KEY_PrtScr,
-  KEY_scrlck,
-  KEY_break,
-  KEY_ins,
-  KEY_home,
-  KEY_pgup,
-  KEY_del,
-  KEY_end,
-  KEY_pgdn,
-  KEY_rarr, 
-  KEY_larr,     // 0x50
-  KEY_darr,
-  KEY_uarr,
-  KEY_numlock,
-  KEY_KPslash,
-  KEY_KPast,
-  KEY_KPminus,
-  KEY_KPplus,
-  KEY_KPenter,
-  KEY_KP1,
-  KEY_KP2,
-  KEY_KP3,
-  KEY_KP4,
-  KEY_KP5,
-  KEY_KP6,
-  KEY_KP7,
-  KEY_KP8,      // 0x60
-  KEY_KP9,
-  KEY_KP0,
-  KEY_KPcomma,
-  KEY_Euro2,
-
-  /* These are NOT standard USB HID - handled specially in decoding,
-     so they will be mapped to the modifier byte in the USB report */
-  KEY_Modifiers,
-  MOD_LCTRL,    // 0x01
-  MOD_LSHIFT,   // 0x02
-  MOD_LALT,     // 0x04
-  MOD_LGUI,     // 0x08
-  MOD_RCTRL,    // 0x10
-  MOD_RSHIFT,   // 0x20
-  MOD_RALT,     // 0x40
-  MOD_RGUI,     // 0x80
-  
-  /* Other keys that need special handling -
-     These are looked up in the table spec_keys because they do not
-     generate the same scan-code in the shifted and unshifted state,
-     and some may need to alter the shift-state to generate the
-     correct character code on the PC */
-  KEY_Special,
-  SPC_del,
-  SPC_F1F5,
-  SPC_F2F6,
-  SPC_F3F7,
-  SPC_F4F8,
-  SPC_2,
-  SPC_3,
-  SPC_quote,
-  SPC_pipe,
-  SPC_up,
-  SPC_down,
-  SPC_left,
-  SPC_right,
-  SPC_grave
-};
-
-/* The keymap for the Commodore 64 keyboard with Danish keys mapping
-   to a PC with danish keyboard mapping */
-const unsigned char keymap[NUMROWS][8] PROGMEM = { // Danish keymap
-    {KEY_F11,     SPC_3,      KEY_5,      KEY_7,      KEY_9,      SPC_down,   SPC_left,   KEY_1}, // row0
-    {KEY_enter,   KEY_W,      KEY_R,      KEY_Y,      KEY_I,      KEY_P,      SPC_pipe,   KEY_F10}, // row1
-    {KEY_rbr,     KEY_A,      KEY_D,      KEY_G,      KEY_J,      KEY_L,      SPC_quote,  SPC_del}, // row2
-    {SPC_F4F8,    KEY_4,      KEY_6,      KEY_8,      KEY_0,      SPC_up,     SPC_right,  SPC_2}, // row3
-    {SPC_F1F5,    KEY_Z,      KEY_C,      KEY_B,      KEY_M,      KEY_dot,    SPC_grave,  KEY_spc}, // row4
-    {SPC_F2F6,    KEY_S,      KEY_F,      KEY_H,      KEY_K,      KEY_smcol,  KEY_F9,     MOD_LCTRL}, // row5
-    {SPC_F3F7,    KEY_E,      KEY_T,      KEY_U,      KEY_O,      KEY_equal,  KEY_minus,  KEY_Q}, // row6
-    {KEY_lbr,     MOD_LSHIFT, KEY_X,      KEY_V,      KEY_N,      KEY_comma,  KEY_slash,  KEY_cpslck}, // row7
-    {0,           0,          0,          0,          0,          0,          0,          0} // Imaginary row8 is for restore
-  };
-
-/* Special keys that need to generate different scan-codes for unshifted
-   and shifted states, or that need to alter the modifier keys. 
+/* The keycode and the modifier changes of every key, in the unshifted
+   and the shifted plane (the latter is used while a shift key is held).
    Since the LGUI and RGUI bits are not used, these signify that the
    left and right shift states should be deleted from report, so
      0x88 means clear both shift flags
      0x00 means do not alter shift states
-     0xC8 means clear both shifts and set L_ALT */
-const unsigned char spec_keys[14][4] PROGMEM = {
-  { KEY_bckspc,  0x00, KEY_del,     0x88}, // SPC_del - backspace and delete
-  { KEY_F1,      0x80, KEY_F5,      0x80}, // SPC_F1F5 - F1 and F5
-  { KEY_F2,      0x80, KEY_F6,      0x80}, // SPC_F2F6 - F2 and F6
-  { KEY_F3,      0x80, KEY_F7,      0x80}, // SPC_F3F7 - F3 and F7
-  { KEY_F4,      0x80, KEY_F8,      0x80}, // SPC_F4F8 - F4 and F8
-  { KEY_2,       0x00, KEY_ping,    0x00}, // SPC_2 - 2 and @
-  { KEY_3,       0x00, KEY_hash,    0x88}, // SPC_3 - shift-3 is #
-  { KEY_ping,    0x00, KEY_2,       0x00}, // SPC_quote - shift-' is "
-  { KEY_Euro2,   0x00, KEY_Euro2,   0x80}, // SPC_pipe - shift-\ is |
-  { KEY_uarr,    0x00, KEY_pgup,    0x88}, // SPC_up - shift-up is pgup
-  { KEY_darr,    0x00, KEY_pgdn,    0x88}, // SPC_down - shift-down is pgdn
-  { KEY_larr,    0x00, KEY_home,    0x88}, // SPC_left - shift-left is home
-  { KEY_rarr,    0x00, KEY_end,     0x88}, // SPC_right - shift-right is end
-  { KEY_grave,   0x00, KEY_hash,    0x00}, // SPC_grave - shift-` is ~
+     0xC8 means clear both shifts and set R_ALT */
+const unsigned char keymap_p4_custom_theodore[2][NUMROWS][8][2] PROGMEM = {
+  { // Unshifted
+    {{KEY_F11,0}, {KEY_3,0}, {KEY_5,0}, {KEY_7,0}, {KEY_9,0}, {KEY_darr,0}, {KEY_larr,0}, {KEY_1,0}}, // row0
+    {{KEY_enter,0}, {KEY_W,0}, {KEY_R,0}, {KEY_Y,0}, {KEY_I,0}, {KEY_P,0}, {KEY_Euro2,0}, {KEY_F10,0}}, // row1
+    {{KEY_rbr,0}, {KEY_A,0}, {KEY_D,0}, {KEY_G,0}, {KEY_J,0}, {KEY_L,0}, {KEY_ping,0}, {KEY_bckspc,0}}, // row2
+    {{KEY_F4,0x80}, {KEY_4,0}, {KEY_6,0}, {KEY_8,0}, {KEY_0,0}, {KEY_uarr,0}, {KEY_rarr,0}, {KEY_2,0}}, // row3
+    {{KEY_F1,0x80}, {KEY_Z,0}, {KEY_C,0}, {KEY_B,0}, {KEY_M,0}, {KEY_dot,0}, {KEY_grave,0}, {KEY_spc,0}}, // row4
+    {{KEY_F2,0x80}, {KEY_S,0}, {KEY_F,0}, {KEY_H,0}, {KEY_K,0}, {KEY_smcol,0}, {KEY_F9,0}, {MOD_LCTRL,0}}, // row5
+    {{KEY_F3,0x80}, {KEY_E,0}, {KEY_T,0}, {KEY_U,0}, {KEY_O,0}, {KEY_equal,0}, {KEY_minus,0}, {KEY_Q,0}}, // row6
+    {{KEY_lbr,0}, {MOD_LSHIFT,0}, {KEY_X,0}, {KEY_V,0}, {KEY_N,0}, {KEY_comma,0}, {KEY_slash,0}, {KEY_cpslck,0}}, // row7
+    {{0,0}, {0,0}, {0,0}, {0,0}, {0,0}, {0,0}, {0,0}, {0,0}} // Imaginary row8 is for restore
+  },
+  { // Shifted
+    {{KEY_F11,0}, {KEY_hash,0x88}, {KEY_5,0}, {KEY_7,0}, {KEY_9,0}, {KEY_pgdn,0x88}, {KEY_home,0x88}, {KEY_1,0}}, // row0
+    {{KEY_enter,0}, {KEY_W,0}, {KEY_R,0}, {KEY_Y,0}, {KEY_I,0}, {KEY_P,0}, {KEY_Euro2,0x80}, {KEY_F10,0}}, // row1
+    {{KEY_rbr,0}, {KEY_A,0}, {KEY_D,0}, {KEY_G,0}, {KEY_J,0}, {KEY_L,0}, {KEY_2,0}, {KEY_del,0x88}}, // row2
+    {{KEY_F8,0x80}, {KEY_4,0}, {KEY_6,0}, {KEY_8,0}, {KEY_0,0}, {KEY_pgup,0x88}, {KEY_end,0x88}, {KEY_ping,0}}, // row3
+    {{KEY_F5,0x80}, {KEY_Z,0}, {KEY_C,0}, {KEY_B,0}, {KEY_M,0}, {KEY_dot,0}, {KEY_hash,0}, {KEY_spc,0}}, // row4
+    {{KEY_F6,0x80}, {KEY_S,0}, {KEY_F,0}, {KEY_H,0}, {KEY_K,0}, {KEY_smcol,0}, {KEY_F9,0}, {MOD_LCTRL,0}}, // row5
+    {{KEY_F7,0x80}, {KEY_E,0}, {KEY_T,0}, {KEY_U,0}, {KEY_O,0}, {KEY_equal,0}, {KEY_minus,0}, {KEY_Q,0}}, // row6
+    {{KEY_lbr,0}, {MOD_LSHIFT,0}, {KEY_X,0}, {KEY_V,0}, {KEY_N,0}, {KEY_comma,0}, {KEY_slash,0}, {KEY_cpslck,0}}, // row7
+    {{0,0}, {0,0}, {0,0}, {0,0}, {0,0}, {0,0}, {0,0}, {0,0}} // Imaginary row8 is for restore
+  }
+};
+
+/* Consumer and system control keys. These are sent on their own interface
+   when the key is pressed together with FN_KEY (C=); each entry holds the
+   matrix position of the key and the usage (see hidusage.h). */
+#define FN_KEY FNPOS(5,7) /* C= */
+const unsigned int fn_keys_p4_custom_theodore[5][2] PROGMEM = {
+  { FNPOS(4,0), CC_VOLUP   }, // F1       - volume up
+  { FNPOS(5,0), CC_VOLDOWN }, // F2       - volume down
+  { FNPOS(6,0), CC_MUTE    }, // F3       - mute
+  { FNPOS(3,0), CC_PLAY    }, // HELP     - play/pause
+  { FNPOS(7,7), SC_SLEEP   }, // RUN/STOP - system sleep
 };
 #endif
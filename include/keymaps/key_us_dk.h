@@ -1,6 +1,7 @@
 /*********************************************************************
  * key_us_dk.h - Keyboard mapping American C64 keyboard to Danish    *
  * keyboard setting on the PC side.                                  *
+ * Generated by tools/keymapc from tools/keymapc/us_dk.kmap          *
  *********************************************************************
  * Spaceman Spiff's Commodire 64 USB Keyboard (c64key for short) is  *
  * is free software; you can redistribute it and/or modify it under  *
@@ -11,205 +12,58 @@
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
  * OBDEV license for further details.                                *
  *********************************************************************/
-#ifndef KEYMAP_H
-#define KEYMAP_H
+#ifndef KEY_US_DK_H
+#define KEY_US_DK_H
 #include <avr/pgmspace.h>
+#include "hidusage.h"
+#include "keycodes.h"
 
 #define C64
 
 /* Number of rows in keyboard matrix */
 #define NUMROWS 9
 
-/* The USB keycodes are enumerated here - the first part is simply
-   an enumeration of the allowed scan-codes used for USB HID devices */
-enum keycodes {
-  KEY__=0,
-  KEY_errorRollOver,
-  KEY_POSTfail,
-  KEY_errorUndefined,
-  KEY_A,        // 4
-  KEY_B,
-  KEY_C,
-  KEY_D,
-  KEY_E,
-  KEY_F,
-  KEY_G, 
-  KEY_H,
-  KEY_I,
-  KEY_J,
-  KEY_K,
-  KEY_L,
-  KEY_M,        // 0x10
-  KEY_N,
-  KEY_O,
-  KEY_P,
-  KEY_Q, 
-  KEY_R,
-  KEY_S,
-  KEY_T,
-  KEY_U,
-  KEY_V,
-  KEY_W,
-  KEY_X,
-  KEY_Y,
-  KEY_Z,
-  KEY_1,
-  KEY_2,
-  KEY_3,        // 0x20
-  KEY_4,
-  KEY_5,
-  KEY_6,
-  KEY_7,
-  KEY_8,
-  KEY_9,
-  KEY_0,        // 0x27
-  KEY_enter,
-  KEY_esc,
-  KEY_bckspc,   // backspace
-  KEY_tab,
-  KEY_spc,      // space
-  KEY_minus,    // - (and _)
-  KEY_equal,    // =
-  KEY_lbr,      // [
-  KEY_rbr,      // ]  -- 0x30
-  KEY_bckslsh,  // \ (and |)
-  KEY_hash,     // Non-US # and ~
-  KEY_smcol,    // ; (and :)
-  KEY_ping,     // ' and "
-  KEY_grave,    // Grave accent and tilde
-  KEY_comma,    // , (and <)
-  KEY_dot,      // . (and >)
-  KEY_slash,    // / (and ?)
-  KEY_cpslck,   // capslock
-  KEY_F1,
-  KEY_F2,
-  KEY_F3,
-  KEY_F4,
-  KEY_F5,
-  KEY_F6, 
-  KEY_F7,       // 0x40
-  KEY_F8,
-  KEY_F9,
-  KEY_F10,
-  KEY_F11,
-  KEY_F12,
-  KEY_PrtScr,
-  KEY_scrlck,
-  KEY_break,
-  KEY_ins,
-  KEY_home,
-  KEY_pgup,
-  KEY_del,
-  KEY_end,
-  KEY_pgdn,
-  KEY_rarr, 
-  KEY_larr,     // 0x50
-  KEY_darr,
-  KEY_uarr,
-  KEY_numlock,
-  KEY_KPslash,
-  KEY_KPast,
-  KEY_KPminus,
-  KEY_KPplus,
-  KEY_KPenter,
-  KEY_KP1,
-  KEY_KP2,
-  KEY_KP3,
-  KEY_KP4,
-  KEY_KP5,
-  KEY_KP6,
-  KEY_KP7,
-  KEY_KP8,      // 0x60
-  KEY_KP9,
-  KEY_KP0,
-  KEY_KPcomma,
-  KEY_Euro2,
-
-  /* These are NOT standard USB HID - handled specially in decoding,
-     so they will be mapped to the modifier byte in the USB report */
-  KEY_Modifiers,
-  MOD_LCTRL,    // 0x01
-  MOD_LSHIFT,   // 0x02
-  MOD_LALT,     // 0x04
-  MOD_LGUI,     // 0x08
-  MOD_RCTRL,    // 0x10
-  MOD_RSHIFT,   // 0x20
-  MOD_RALT,     // 0x40
-  MOD_RGUI,     // 0x80
-  
-  /* Other keys that need special handling -
-     These are looked up in the table spec_keys because they do not
-     generate the same scan-code in the shifted and unshifted state,
-     and some may need to alter the shift-state to generate the
-     correct character code on the PC */
-  KEY_Special,
-  SPC_4,
-  SPC_7,
-  SPC_0,
-  SPC_plus,
-  SPC_minus,
-  SPC_pound,
-  SPC_home,
-  SPC_del,
-  SPC_ast,
-  SPC_equal,
-  SPC_comma,
-  SPC_dot,
-  SPC_slash,
-  SPC_crsrud,
-  SPC_crsrlr,
-  SPC_F1,
-  SPC_F3,
-  SPC_F5,
-  SPC_F7,
-  SPC_at,
-  SPC_colon,
-  SPC_smcol
-};
-
-/* The keymap for the Commodore 64 keyboard with Danish keys mapping
-   to a PC with danish keyboard mapping */
-const unsigned char keymap[NUMROWS][8] PROGMEM = { // Danish keymap
-    {SPC_del, KEY_3, KEY_5, SPC_7, KEY_9, KEY_larr, KEY_uarr, KEY_1}, // row0
-    {KEY_enter, KEY_W, KEY_R, KEY_Y, KEY_I, KEY_P, SPC_ast, KEY_esc}, // row1
-    {SPC_crsrlr, KEY_A, KEY_D, KEY_G, KEY_J, KEY_L, SPC_smcol, MOD_LCTRL}, // row2
-    {SPC_F7, SPC_4, KEY_6, KEY_8, SPC_0, SPC_minus, SPC_home, KEY_2}, // row3
-    {SPC_F1, KEY_Z, KEY_C, KEY_B, KEY_M, SPC_dot, MOD_RSHIFT, KEY_spc}, // row4
-    {SPC_F3, KEY_S, KEY_F, KEY_H, KEY_K, SPC_colon, SPC_equal, MOD_LALT}, // row5
-    {SPC_F5, KEY_E, KEY_T, KEY_U, KEY_O, SPC_at, KEY_rbr, KEY_Q}, // row6
-    {SPC_crsrud, MOD_LSHIFT, KEY_X, KEY_V, KEY_N, SPC_comma, SPC_slash, MOD_RALT}, // row7
-    {0, 0, 0, MOD_RCTRL, 0, 0, 0, 0} // Imaginary row8 is for restore
-  };
-
-/* Special keys that need to generate different scan-codes for unshifted
-   and shifted states, or that need to alter the modifier keys. 
+/* The keycode and the modifier changes of every key, in the unshifted
+   and the shifted plane (the latter is used while a shift key is held).
    Since the LGUI and RGUI bits are not used, these signify that the
    left and right shift states should be deleted from report, so
      0x88 means clear both shift flags
      0x00 means do not alter shift states
      0xC8 means clear both shifts and set R_ALT */
-const unsigned char spec_keys[22][4] PROGMEM = {
-  { KEY_4,       0x00, KEY_4,       0xC8}, // SPEC_4 - shift-4 is $
-  { KEY_7,       0x00, KEY_bckslsh, 0x88}, // SPEC_7 - shift-7 is '
-  { KEY_0,       0x00, KEY_0,       0x88}, // SPEC_0
-  { KEY_minus,   0x88, KEY_minus,   0x88}, // SPC_plus 
-  { KEY_slash,   0x88, KEY_slash,   0x88}, // SPC_minus - "-" and "="
-  { KEY_3,       0xC8, KEY_3,       0xC8}, // SPC_pound - �
-  { KEY_home,    0x80, KEY_end,     0x80}, // SPC_home - home and end
-  { KEY_bckspc,  0x00, KEY_del,     0x88}, // SPC_del - backspace and delete
-  { KEY_bckslsh, 0x82, KEY_bckslsh, 0x8A}, // SPC_ast - "*" (Asterix)
-  { KEY_0,       0x82, KEY_0,       0x82}, // SPC_equal - =
-  { KEY_comma,   0x80, KEY_Euro2,   0x88}, // SPC_comma - "," and "<"
-  { KEY_dot,     0x80, KEY_Euro2,   0x8A}, // SPC_dot - "." and ">"
-  { KEY_7,       0x82, KEY_minus,   0x8A}, // SPC_slash - "/" and "?"
-  { KEY_darr,    0x80, KEY_uarr,    0x80}, // SPC_crsrud - cursor down/up
-  { KEY_rarr,    0x80, KEY_larr,    0x80}, // SPC_crsrlr - cursor right/left
-  { KEY_F1,      0x80, KEY_F2,      0x80}, // SPC_F1 - F1 and F2
-  { KEY_F3,      0x80, KEY_F4,      0x80}, // SPC_F3 - F3 and F4
-  { KEY_F5,      0x80, KEY_F6,      0x80}, // SPC_F5 - F5 and F6
-  { KEY_F7,      0x80, KEY_F8,      0x80}, // SPC_F7 - F7 and F8
-  { KEY_2,       0xC8, KEY_2,       0xC8}, // SPC_at - @
-  { KEY_dot,     0x82, KEY_8,       0xC8}, // SPC_colon - : and [
-  { KEY_comma,   0x82, KEY_9,       0xC8}, // SPC_smcol - ; and ]
+const unsigned char keymap_us_dk[2][NUMROWS][8][2] PROGMEM = {
+  { // Unshifted
+    {{KEY_bckspc,0}, {KEY_3,0}, {KEY_5,0}, {KEY_7,0}, {KEY_9,0}, {KEY_larr,0}, {KEY_uarr,0}, {KEY_1,0}}, // row0
+    {{KEY_enter,0}, {KEY_W,0}, {KEY_R,0}, {KEY_Y,0}, {KEY_I,0}, {KEY_P,0}, {KEY_bckslsh,0x82}, {KEY_esc,0}}, // row1
+    {{KEY_rarr,0x80}, {KEY_A,0}, {KEY_D,0}, {KEY_G,0}, {KEY_J,0}, {KEY_L,0}, {KEY_comma,0x82}, {MOD_LCTRL,0}}, // row2
+    {{KEY_F7,0x80}, {KEY_4,0}, {KEY_6,0}, {KEY_8,0}, {KEY_0,0}, {KEY_slash,0x88}, {KEY_home,0x80}, {KEY_2,0}}, // row3
+    {{KEY_F1,0x80}, {KEY_Z,0}, {KEY_C,0}, {KEY_B,0}, {KEY_M,0}, {KEY_dot,0x80}, {MOD_RSHIFT,0}, {KEY_spc,0}}, // row4
+    {{KEY_F3,0x80}, {KEY_S,0}, {KEY_F,0}, {KEY_H,0}, {KEY_K,0}, {KEY_dot,0x82}, {KEY_0,0x82}, {MOD_LALT,0}}, // row5
+    {{KEY_F5,0x80}, {KEY_E,0}, {KEY_T,0}, {KEY_U,0}, {KEY_O,0}, {KEY_2,0xC8}, {KEY_rbr,0}, {KEY_Q,0}}, // row6
+    {{KEY_darr,0x80}, {MOD_LSHIFT,0}, {KEY_X,0}, {KEY_V,0}, {KEY_N,0}, {KEY_comma,0x80}, {KEY_7,0x82}, {MOD_RALT,0}}, // row7
+    {{0,0}, {0,0}, {0,0}, {MOD_RCTRL,0}, {0,0}, {0,0}, {0,0}, {0,0}} // Imaginary row8 is for restore
+  },
+  { // Shifted
+    {{KEY_del,0x88}, {KEY_3,0}, {KEY_5,0}, {KEY_bckslsh,0x88}, {KEY_9,0}, {KEY_larr,0}, {KEY_uarr,0}, {KEY_1,0}}, // row0
+    {{KEY_enter,0}, {KEY_W,0}, {KEY_R,0}, {KEY_Y,0}, {KEY_I,0}, {KEY_P,0}, {KEY_bckslsh,0x8A}, {KEY_esc,0}}, // row1
+    {{KEY_larr,0x80}, {KEY_A,0}, {KEY_D,0}, {KEY_G,0}, {KEY_J,0}, {KEY_L,0}, {KEY_9,0xC8}, {MOD_LCTRL,0}}, // row2
+    {{KEY_F8,0x80}, {KEY_4,0xC8}, {KEY_6,0}, {KEY_8,0}, {KEY_0,0x88}, {KEY_slash,0x88}, {KEY_end,0x80}, {KEY_2,0}}, // row3
+    {{KEY_F2,0x80}, {KEY_Z,0}, {KEY_C,0}, {KEY_B,0}, {KEY_M,0}, {KEY_Euro2,0x8A}, {MOD_RSHIFT,0}, {KEY_spc,0}}, // row4
+    {{KEY_F4,0x80}, {KEY_S,0}, {KEY_F,0}, {KEY_H,0}, {KEY_K,0}, {KEY_8,0xC8}, {KEY_0,0x82}, {MOD_LALT,0}}, // row5
+    {{KEY_F6,0x80}, {KEY_E,0}, {KEY_T,0}, {KEY_U,0}, {KEY_O,0}, {KEY_2,0xC8}, {KEY_rbr,0}, {KEY_Q,0}}, // row6
+    {{KEY_uarr,0x80}, {MOD_LSHIFT,0}, {KEY_X,0}, {KEY_V,0}, {KEY_N,0}, {KEY_Euro2,0x88}, {KEY_minus,0x8A}, {MOD_RALT,0}}, // row7
+    {{0,0}, {0,0}, {0,0}, {MOD_RCTRL,0}, {0,0}, {0,0}, {0,0}, {0,0}} // Imaginary row8 is for restore
+  }
+};
+
+/* Consumer and system control keys. These are sent on their own interface
+   when the key is pressed together with FN_KEY (C=); each entry holds the
+   matrix position of the key and the usage (see hidusage.h). */
+#define FN_KEY FNPOS(5,7) /* C= */
+const unsigned int fn_keys_us_dk[5][2] PROGMEM = {
+  { FNPOS(4,0), CC_VOLUP   }, // F1       - volume up
+  { FNPOS(5,0), CC_VOLDOWN }, // F3       - volume down
+  { FNPOS(6,0), CC_MUTE    }, // F5       - mute
+  { FNPOS(3,0), CC_PLAY    }, // F7       - play/pause
+  { FNPOS(7,7), SC_SLEEP   }, // RUN/STOP - system sleep
 };
 #endif
@@ -20,17 +20,31 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/wdt.h>
+#include <avr/sleep.h>
+#include <avr/eeprom.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 #include <string.h>
+#include <stddef.h>
 
-/* Now included from the makefile */
+/* The keymaps built into the firmware, all for the same machine (C64, C16
+   or Plus/4). The first one is used until another one is chosen. Each
+   takes 313 bytes of flash, so the list holds the host layouts of one
+   physical keyboard, here the US C64 keyboard (see doc.txt). */
 #include "keymaps/key_c64_us_de.h"
+#include "keymaps/key_us_us.h"
+#include "keymaps/key_us_dk.h"
+#define KEYMAP_LIST KEYMAP(c64_us_de), KEYMAP(us_us), KEYMAP(us_dk)
+
+#if defined(C64)+defined(C16)+defined(PLUS4)!=1
+#error "The keymaps must all be for the same machine"
+#endif
 
 #include "usbdrv.h"
 #define DEBUG_LEVEL 0
 #include "oddebug.h"
 
-#define MAX_SUSPEND_CNT 10 // in Seconds * 2. No USB Interrupt for this amount of time and the keyboard will send a wakeup call on next keypress instead of the key
+#define MAX_SUSPEND_CNT 59 // in Timer 0 ticks (~5 ms). No USB activity for this amount of time and the keyboard suspends
 
 /* Hardware documentation:
  * ATmega-8 @12.000 MHz
@@ -38,10 +52,10 @@
  * PB0..PB5: Keyboard matrix Row0..Row5 (pins 12,11,10,5,8,7 on C64 kbd)
  * PB6..PB7: 12MHz X-tal
  * PC0..PC5: Keyboard matrix Col0..Col5 (pins 13,19,18,17,16,15 on C64 kbd)
- * PD0     : D- USB negative (needs appropriate zener-diode and resistors)
- * PD1     : UART TX
- * PD2/INT0: D+ USB positive (needs appropriate zener-diode and resistors)
- * PD3     : Keyboard matrix Row8 (Restore key)
+ * PD0     : D+ USB positive (needs appropriate zener-diode and resistors)
+ * PD1     : LED (to GND through a resistor), formerly UART TX
+ * PD2/INT0: D- USB negative (needs appropriate zener-diode and resistors)
+ * PD3/INT1: Restore key (Keyboard matrix Row8 on the Plus/4)
  * PD4     : Keyboard matrix Row6 (pin 6 on C64 kbd)
  * PD5     : Keyboard matrix Row7 (pin 9 on C64 kbd)
  * PD6     : Keyboard matrix Col6 (pin 14 on C64 kbd)
@@ -60,16 +74,25 @@
  *                  +--[4k7]--+--[2k2]--+
  *      USB        GND        |                     ATmega-8
  *                            |
- *      (D-)-------+----------+--------[82r]------- PD0
+ *      (D-)-------+----------+--------[82r]------- PD2/INT0
  *                 |
- *      (D+)-------|-----+-------------[82r]------- PD2/INT0
+ *      (D+)-------|-----+-------------[82r]------- PD0
  *                 |     |
  *                 _     _
  *                 ^     ^  2 x 3.6V 
  *                 |     |  zener to GND
  *                 |     |
  *                GND   GND
+ *
+ * The ATmega-16 version also has the two C64 control ports (DE-9, lines
+ * active low, GND on pin 8), on pins the ATmega-8 does not have:
+ * PA0..PA4: Control port 1 up, down, left, right, fire (pins 1,2,3,4,6)
+ * PA5..PA7: Control port 2 up, down, left (pins 1,2,3)
+ * PB6..PB7: Control port 2 right, fire (pins 4,6)
  */
+#if defined(__AVR_ATmega16__)
+#define JOYSTICK
+#endif
 
 /* The LED states */
 #define LED_NUM     0x01
@@ -85,15 +108,65 @@ const char modmask[8] PROGMEM = {
     0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80
   };
 
+/* The tables of the keymaps in KEYMAP_LIST. A keymap holds the keycode
+   and the modifier changes of every key in two planes, the unshifted one
+   and the shifted one, so a key is decoded with a single lookup. */
+#define KM_PLANE (NUMROWS*8*2)    /* Bytes in a plane */
+
+typedef struct {
+  const unsigned char *keys;      /* keymap, two planes */
+  const unsigned int (*fn)[2];    /* fn_keys */
+  uchar fns;                      /* Entries in fn_keys */
+} keymap_t;
+
+#define KEYMAP(name) { &keymap_##name[0][0][0][0], fn_keys_##name, \
+    sizeof(fn_keys_##name)/sizeof(fn_keys_##name[0]) }
+
+const keymap_t keymaps[] PROGMEM = { KEYMAP_LIST };
+
+#define KEYMAPS (sizeof(keymaps)/sizeof(keymaps[0]))
+
+/* A keymap uploaded by the host as two feature reports, one per plane
+   (see keymapWrite() below), in the format of those reports. It is kept
+   in EEPROM, used from a copy in RAM, and chosen with the digit after
+   those of KEYMAP_LIST. Its fn_keys are those of the first keymap. */
+typedef struct {
+  uchar id;                  /* REPORT_ID_KEYMAP */
+  uchar keys[KM_PLANE];      /* Unshifted plane */
+  uchar id2;                 /* REPORT_ID_SHIFTED */
+  uchar shifted[KM_PLANE];   /* Shifted plane */
+  uint16_t sum;              /* CRC-16 of both planes (_crc16_update) */
+} userkeymap_t;
+
+#define USER_PLANE (offsetof(userkeymap_t,shifted)-offsetof(userkeymap_t,keys))
+
 
 /* USB report descriptor (length is defined in usbconfig.h)
-   This has been changed to conform to the USB keyboard boot
-   protocol */
+   In report protocol the keyboard has two collections. REPORT_ID_KEYS
+   holds the modifier byte and up to five keycodes, 7 bytes, so it is a
+   short packet that ends the interrupt transfer on its own (the host
+   sizes the transfers for REPORT_ID_NKRO, and a full 8 byte packet would
+   not end one). It is all that is sent while five keys or less are down.
+   The keys pressed beyond those go to REPORT_ID_NKRO, a bitmap with
+   one bit per usage (NKRO_KEYS usages), which takes two packets. A key
+   stays in the report it was put in until it is released, so the host
+   never sees it move. In boot protocol (selected by a BIOS with
+   SET_PROTOCOL) the fixed 8 byte boot report is sent instead, as the boot
+   protocol does not use this descriptor. */
+#define REPORT_ID_KEYS 1
+#define REPORT_ID_NKRO 2
+#define NKRO_KEYS   104          /* Usages 0x00-0x67 */
+#define BOOT_REPORT 8            /* Size of the boot protocol report */
+#define KEYS_REPORT 7            /* Size of report REPORT_ID_KEYS */
+#define REPORT_KEYS (KEYS_REPORT-2) /* Keycodes in it */
+#define NKRO_REPORT (1+NKRO_KEYS/8) /* Size of report REPORT_ID_NKRO */
+
 char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH] 
   PROGMEM = {
     0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
     0x09, 0x06,                    // USAGE (Keyboard)
     0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, REPORT_ID_KEYS,          //   REPORT_ID (1)
     0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
     0x19, 0xe0,                    //   USAGE_MINIMUM (Keyboard LeftControl)
     0x29, 0xe7,                    //   USAGE_MAXIMUM (Keyboard Right GUI)
@@ -102,9 +175,6 @@ char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
     0x75, 0x01,                    //   REPORT_SIZE (1)
     0x95, 0x08,                    //   REPORT_COUNT (8)
     0x81, 0x02,                    //   INPUT (Data,Var,Abs)
-    0x95, 0x01,                    //   REPORT_COUNT (1)
-    0x75, 0x08,                    //   REPORT_SIZE (8)
-    0x81, 0x03,                    //   INPUT (Cnst,Var,Abs)
     0x95, 0x05,                    //   REPORT_COUNT (5)
     0x75, 0x01,                    //   REPORT_SIZE (1)
     0x05, 0x08,                    //   USAGE_PAGE (LEDs)
@@ -114,35 +184,344 @@ char usbHidReportDescriptor[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH]
     0x95, 0x01,                    //   REPORT_COUNT (1)
     0x75, 0x03,                    //   REPORT_SIZE (3)
     0x91, 0x03,                    //   OUTPUT (Cnst,Var,Abs)
-    0x95, 0x06,                    //   REPORT_COUNT (6)
+    0x95, REPORT_KEYS,             //   REPORT_COUNT (5)
     0x75, 0x08,                    //   REPORT_SIZE (8)
     0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
-    0x25, 0x65,                    //   LOGICAL_MAXIMUM (101)
+    0x25, NKRO_KEYS-1,             //   LOGICAL_MAXIMUM (103)
     0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
     0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))
-    0x29, 0x65,                    //   USAGE_MAXIMUM (Keyboard Application)
+    0x29, NKRO_KEYS-1,             //   USAGE_MAXIMUM (Keypad =)
     0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
-    0xc0                           // END_COLLECTION  
+    0xc0,                          // END_COLLECTION
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x06,                    // USAGE (Keyboard)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, REPORT_ID_NKRO,          //   REPORT_ID (2)
+    0x95, NKRO_KEYS,               //   REPORT_COUNT (104)
+    0x75, 0x01,                    //   REPORT_SIZE (1)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x25, 0x01,                    //   LOGICAL_MAXIMUM (1)
+    0x05, 0x07,                    //   USAGE_PAGE (Keyboard)
+    0x19, 0x00,                    //   USAGE_MINIMUM (Reserved (no event indicated))
+    0x29, NKRO_KEYS-1,             //   USAGE_MAXIMUM (Keypad =)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+    0xc0                           // END_COLLECTION
 };
 
-/* This buffer holds the last values of the scanned keyboard matrix */
+/* The consumer and system control keys (fn_keys in the keymap) have an
+   interface of their own, with a second interrupt endpoint (EP3), so they
+   take no room in the keyboard report and are sent independently of it.
+   A report holds the usage of the key held, or 0 once it is released.
+   On the ATmega16, the two joysticks are a gamepad on the same interface,
+   and the performance counters are a feature report of it. */
+#define CTRL_INTERFACE     1
+#define REPORT_ID_CONSUMER 1
+#define REPORT_ID_SYSTEM   2
+#define REPORT_ID_JOY      3 /* (4 is not used) */
+#define REPORT_ID_STATS    5
+#define REPORT_ID_KEYMAP   6
+#define REPORT_ID_SHIFTED  7
+
+/* The two joysticks as one gamepad, X and Y for port 1 and Z and Rz for
+   port 2 (-127, 0 or 127) and a fire button each, so a change of both
+   ports reaches the host in a single report */
+#define JOY_REPORT_DESCRIPTOR \
+    0x05, 0x01,                    /* USAGE_PAGE (Generic Desktop) */ \
+    0x09, 0x05,                    /* USAGE (Game Pad) */ \
+    0xa1, 0x01,                    /* COLLECTION (Application) */ \
+    0x85, REPORT_ID_JOY,           /*   REPORT_ID (3) */ \
+    0x09, 0x01,                    /*   USAGE (Pointer) */ \
+    0xa1, 0x00,                    /*   COLLECTION (Physical) */ \
+    0x09, 0x30,                    /*     USAGE (X) */ \
+    0x09, 0x31,                    /*     USAGE (Y) */ \
+    0x09, 0x32,                    /*     USAGE (Z) */ \
+    0x09, 0x35,                    /*     USAGE (Rz) */ \
+    0x15, 0x81,                    /*     LOGICAL_MINIMUM (-127) */ \
+    0x25, 0x7f,                    /*     LOGICAL_MAXIMUM (127) */ \
+    0x75, 0x08,                    /*     REPORT_SIZE (8) */ \
+    0x95, 0x04,                    /*     REPORT_COUNT (4) */ \
+    0x81, 0x02,                    /*     INPUT (Data,Var,Abs) */ \
+    0xc0,                          /*   END_COLLECTION */ \
+    0x05, 0x09,                    /*   USAGE_PAGE (Button) */ \
+    0x19, 0x01,                    /*   USAGE_MINIMUM (Button 1) */ \
+    0x29, 0x02,                    /*   USAGE_MAXIMUM (Button 2) */ \
+    0x15, 0x00,                    /*   LOGICAL_MINIMUM (0) */ \
+    0x25, 0x01,                    /*   LOGICAL_MAXIMUM (1) */ \
+    0x75, 0x01,                    /*   REPORT_SIZE (1) */ \
+    0x95, 0x02,                    /*   REPORT_COUNT (2) */ \
+    0x81, 0x02,                    /*   INPUT (Data,Var,Abs) */ \
+    0x75, 0x06,                    /*   REPORT_SIZE (6) */ \
+    0x95, 0x01,                    /*   REPORT_COUNT (1) */ \
+    0x81, 0x03,                    /*   INPUT (Cnst,Var,Abs) */ \
+    0xc0                           /* END_COLLECTION */
+
+/* Performance counters, read by the host as a vendor defined feature
+   report. The counters wrap around and are never cleared, so the host
+   takes the difference of two reads; only the maxima start over at every
+   read. With SCAN_STATS set, the report also holds the age histogram of
+   the frame schedule (see scanAge below). */
+#define SCAN_STATS 0
+#ifdef JOYSTICK
+#define TASKS 13 /* Entries in the task table (see tasks below) */
+#else
+#define TASKS 12
+#endif
+
+typedef struct {
+  uchar id;            /* REPORT_ID_STATS */
+  uint16_t scanRate;   /* Frames scanned in the last second */
+  uint16_t restarts;   /* Debounce counts restarted by a bounce */
+  uint16_t rollovers;  /* Keys that did not fit in the report */
+  uint16_t sent;       /* Packets sent on the keyboard endpoint */
+  uint16_t suppressed; /* Report states merged while the endpoint was busy */
+  uint16_t resets;     /* USB bus resets */
+  uint16_t suspends;   /* Suspends of the bus */
+  uchar worstLoop;     /* Longest pass of the main loop, in timer 0 ticks */
+  uint16_t taskWorst[TASKS]; /* Longest run of every task, in timer 1 ticks */
+#if SCAN_STATS
+  uint16_t scanAge[8];
+#endif
+} stats_t;
+
+static stats_t stats={REPORT_ID_STATS};
+static stats_t statsReport; /* Copy being sent to the host */
+static uint16_t statsFrames; /* Frames scanned in the current second */
+static uchar loopStamp;     /* TCNT0 at the start of the main loop pass */
+
+const char ctrlReportDescriptor[] PROGMEM = {
+    0x05, 0x0c,                    // USAGE_PAGE (Consumer Devices)
+    0x09, 0x01,                    // USAGE (Consumer Control)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, REPORT_ID_CONSUMER,      //   REPORT_ID (1)
+    0x16, 0x01, 0x00,              //   LOGICAL_MINIMUM (1)
+    0x26, 0x9c, 0x02,              //   LOGICAL_MAXIMUM (668)
+    0x1a, 0x01, 0x00,              //   USAGE_MINIMUM (Consumer Control)
+    0x2a, 0x9c, 0x02,              //   USAGE_MAXIMUM (AC Distribute Vertically)
+    0x75, 0x10,                    //   REPORT_SIZE (16)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    0xc0,                          // END_COLLECTION
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x80,                    // USAGE (System Control)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, REPORT_ID_SYSTEM,        //   REPORT_ID (2)
+    0x16, 0x81, 0x00,              //   LOGICAL_MINIMUM (129)
+    0x26, 0x83, 0x00,              //   LOGICAL_MAXIMUM (131)
+    0x1a, 0x81, 0x00,              //   USAGE_MINIMUM (System Power Down)
+    0x2a, 0x83, 0x00,              //   USAGE_MAXIMUM (System Wake Up)
+    0x75, 0x10,                    //   REPORT_SIZE (16)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    0xc0,                          // END_COLLECTION
+    0x06, 0x00, 0xff,              // USAGE_PAGE (Vendor Defined Page 1)
+    0x09, 0x01,                    // USAGE (Vendor Usage 1)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, REPORT_ID_STATS,         //   REPORT_ID (5)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+    0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x95, sizeof(stats_t)-1,       //   REPORT_COUNT (counter bytes)
+    0x09, 0x01,                    //   USAGE (Vendor Usage 1)
+    0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0x85, REPORT_ID_KEYMAP,        //   REPORT_ID (6)
+    0x95, KM_PLANE,                //   REPORT_COUNT (unshifted plane)
+    0x09, 0x02,                    //   USAGE (Vendor Usage 2)
+    0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0x85, REPORT_ID_SHIFTED,       //   REPORT_ID (7)
+    0x95, KM_PLANE+2,              //   REPORT_COUNT (shifted plane, CRC)
+    0x09, 0x03,                    //   USAGE (Vendor Usage 3)
+    0xb1, 0x02,                    //   FEATURE (Data,Var,Abs)
+    0xc0,                          // END_COLLECTION
+#ifdef JOYSTICK
+    JOY_REPORT_DESCRIPTOR,
+#endif
+};
+
+/* With two interfaces, the configuration descriptor is our own. The HID
+   descriptors in it are also returned by usbFunctionDescriptor(). */
+#define HID_DESCR_KEYBOARD 18 /* Offsets of the HID descriptors */
+#define HID_DESCR_CTRL     43
+
+PROGMEM const char usbDescriptorConfiguration[59] = {
+    9, USBDESCR_CONFIG, 59, 0,     // configuration, total length
+    2, 1, 0,                       //   interfaces, index, no string
+    (1<<7)|USBATTR_REMOTEWAKE,     //   attributes
+    USB_CFG_MAX_BUS_POWER/2,       //   max current in 2 mA units
+    9, USBDESCR_INTERFACE, 0, 0, 1, // interface 0 (keyboard), 1 endpoint
+    USB_CFG_INTERFACE_CLASS, USB_CFG_INTERFACE_SUBCLASS,
+    USB_CFG_INTERFACE_PROTOCOL, 0,
+    9, USBDESCR_HID, 0x01, 0x01, 0, 1, // HID 1.01, 1 report descriptor
+    USBDESCR_HID_REPORT, USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH, 0,
+    7, USBDESCR_ENDPOINT, 0x81, 0x03, 8, 0, // EP1 IN, interrupt, 8 bytes
+    USB_CFG_INTR_POLL_INTERVAL,
+    9, USBDESCR_INTERFACE, CTRL_INTERFACE, 0, 1, // interface 1 (control keys)
+    0x03, 0, 0, 0,                 //   HID, no boot protocol
+    9, USBDESCR_HID, 0x01, 0x01, 0, 1, // HID 1.01, 1 report descriptor
+    USBDESCR_HID_REPORT, sizeof(ctrlReportDescriptor), 0,
+    7, USBDESCR_ENDPOINT, 0x80|USB_CFG_EP3_NUMBER, 0x03, 8, 0, // EP3 IN
+    USB_CFG_INTR_POLL_INTERVAL
+};
+
+/* Return the HID and report descriptors of the interface in wIndex */
+usbMsgLen_t usbFunctionDescriptor(usbRequest_t *rq) {
+  uchar ctrl=(rq->wIndex.bytes[0]==CTRL_INTERFACE);
+
+  if (rq->wValue.bytes[1]==USBDESCR_HID) {
+    usbMsgPtr=(usbMsgPtr_t)(usbDescriptorConfiguration+
+                            (ctrl?HID_DESCR_CTRL:HID_DESCR_KEYBOARD));
+    return 9;
+  } else if (rq->wValue.bytes[1]==USBDESCR_HID_REPORT) {
+    if (ctrl) {
+      usbMsgPtr=(usbMsgPtr_t)ctrlReportDescriptor;
+      return sizeof(ctrlReportDescriptor);
+    }
+    usbMsgPtr=(usbMsgPtr_t)usbDescriptorHidReport;
+    return USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH;
+  }
+  return 0;
+}
+
+/* Number of consecutive identical scans a key must show before a change
+   is accepted (1..16). Every key is debounced on its own, so a bouncing
+   key does not hold back the report of any other key. */
+#define DEBOUNCE 8
+
+/* With EAGER_PRESS set, a key press is reported on the first scan that
+   sees it, and the key then ignores the matrix for LOCKOUT scans (1..16)
+   so the bounces that follow cannot produce a release. Releases are
+   always integrated over DEBOUNCE scans. */
+#define EAGER_PRESS 1
+#define LOCKOUT 12
+
+/* This buffer holds the debounced state of the keyboard matrix */
 static uchar bitbuf[NUMROWS]={0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff};
 
+/* The matrix state behind the current report: the debounced state with
+   the ghost keys removed (same polarity as bitbuf, 0 = key down) */
+static uchar repbuf[NUMROWS]={0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff};
+
+/* Rows driven by the scanner. On the C64 the restore key has its own
+   line (PD3/INT1), which is handled by an interrupt instead, and row 8
+   of the keymap only holds its keycode. */
+#ifdef PLUS4
+#define SCANROWS NUMROWS
+#else
+#define SCANROWS 8
+#define RESTORE_ROW 8
+#endif
+
+/* Vertical counters: bit n of vcnt0..3[row] forms a 4-bit counter for
+   the key in column n, counting scans that differ from bitbuf[row] (or
+   the scans of the lockout window, for keys set in vlock[row]) */
+static uchar vcnt0[SCANROWS], vcnt1[SCANROWS], vcnt2[SCANROWS], vcnt3[SCANROWS];
+#if EAGER_PRESS
+static uchar vlock[SCANROWS];
+#endif
+
+/* Chatter quarantine. Every change of state of a key is counted in the
+   vertical counters flap0..3, which are cleared every CHATTER_WINDOW
+   ms by the chatterWindow() task. A key that changes state
+   CHATTER_FLAPS times within a window is set in quarantine[], and is
+   seen as released by the report until it has stayed released and quiet
+   for a whole window. Keys found down at power-on are quarantined too,
+   so a stuck key does not block the keyboard from the start. */
+#define CHATTER_FLAPS  15 /* 1..16, far above any human typing rate */
+#define CHATTER_WINDOW 250 /* ms */
+
+static uchar flap0[SCANROWS], flap1[SCANROWS], flap2[SCANROWS], flap3[SCANROWS];
+static uchar quarantine[SCANROWS];
+
+/* Mask of the keys whose vertical counter (c0..c3) equals the constant n */
+#define VCNT_IS(n) ((((n)&1)?c0:~c0)&(((n)&2)?c1:~c1)& \
+                    (((n)&4)?c2:~c2)&(((n)&8)?c3:~c3))
+
 /* The ReportBuffer contains the USB report sent to the PC */
-static uchar reportBuffer[8];    /* buffer for HID reports */
-static uchar idleRate;           /* in 4 ms units */
+static uchar reportBuffer[KEYS_REPORT+NKRO_REPORT]; /* buffer for HID reports */
 static uchar protocolVer=1;      /* 0 is the boot protocol, 1 is report protocol */
 
-volatile uchar LEDstate=0;
+/* Idle rates (in 4 ms units, 0 for none) of the keyboard reports
+   (IDLE_KEYS, which is also the boot report, and IDLE_NKRO) and of the
+   input reports of the control interface (entry = report ID). SET_IDLE
+   with report ID 0 sets all the reports of its interface.
+   A report that has not been sent for its idle time is sent again. The
+   time is counted in USB frames, so it runs exactly on the host's clock,
+   and starts over whenever the report is sent. */
+#define IDLE_FRAMES 4 /* USB frames per 4 ms unit */
+#ifdef JOYSTICK
+#define IDLE_REPORTS (REPORT_ID_JOY+1)
+#else
+#define IDLE_REPORTS (REPORT_ID_SYSTEM+1)
+#endif
+#define IDLE_KEYS 0            /* REPORT_ID_KEYS */
+#define IDLE_NKRO IDLE_REPORTS /* REPORT_ID_NKRO */
+#define IDLE_ENTRIES (IDLE_NKRO+1)
+
+static uchar idleRate[IDLE_ENTRIES];
+static uint16_t idleStamp[IDLE_ENTRIES]; /* idleNow at the last send */
+static uint16_t idleNow; /* USB frames counted */
+static uchar idleFrame;  /* usbSofCount at the last count */
+static uchar idleDue;    /* Reports to repeat, one bit per entry */
+
+/* A report has been sent: start its idle time over */
+static void idleReset(uchar i) {
+  idleStamp[i]=idleNow;
+  idleDue&=~(1<<i);
+}
+
+/* Count the USB frames, and flag the reports whose idle time is over */
+static void idleTask(void) {
+  uchar i;
+
+  if (usbSofCount==idleFrame) return;
+  idleNow+=(uchar)(usbSofCount-idleFrame);
+  idleFrame=usbSofCount;
+  for (i=0;i<IDLE_ENTRIES;++i) {
+    if (idleRate[i] &&
+        idleNow-idleStamp[i]>=(uint16_t)idleRate[i]*IDLE_FRAMES) {
+      idleDue|=1<<i;
+    }
+  }
+}
+
+volatile uchar LEDstate=0; /* LED report from the host */
+
+/* The LED on PD1. It is lit by the host LEDs in LED_SHOW, and with
+   LED_ACTIVITY set, it flashes (inverts) briefly on every key press.
+   With LED_DIAG set, it blinks instead while the host has not configured
+   the device (fast), or while a key is in quarantine (slow). All of it is
+   done by the ledTask() task every LED_PERIOD ms; the scanner only sets
+   ledFlash. */
+#define LED_PIN      0x02     /* PD1 */
+#define LED_SHOW     LED_CAPS
+#define LED_ACTIVITY 1
+#define LED_DIAG     1
+#define LED_PERIOD   8        /* ms */
+#define LED_STEP     8        /* Runs per step of a blink pattern (64 ms) */
+#define LED_FLASH    8        /* Runs of an activity flash */
+#define LED_FAST     0x55     /* Blink patterns, one bit per step */
+#define LED_SLOW     0x0F
+
+static uchar ledFlash; /* Runs left of the activity flash */
+static uchar ledRuns;  /* Runs left of the blink step */
+static uchar ledStep;  /* Step in the blink pattern */
+static uchar ledBlink; /* Blink pattern, or 0 for none */
+static uchar ledOn;    /* Current state of the LED */
 
 static void hardwareInit(void) {
   PORTB = 0x3F;   /* Port B are row drivers */
   DDRB  = 0x00;   /* TODO: all pins output */
+#ifdef JOYSTICK
+  MCUCSR = (1<<JTD); /* JTAG off, PC2..PC5 are columns */
+  MCUCSR = (1<<JTD);
+  PORTA = 0xff;   /* Joystick lines: inputs with pull-ups */
+  DDRA  = 0x00;
+  PORTB |= 0xC0;
+#endif
 
   PORTC = 0xff;   /* activate all pull-ups */
   DDRC  = 0x00;   /* all pins input */
   
-  PORTD = 0xfa;   /* 1111 1000 bin: activate pull-ups except on USB lines */
+  PORTD = 0xf8;   /* 1111 1000 bin: activate pull-ups except on USB lines and LED */
   DDRD  = 0x07;   /* 0000 0111 bin: all pins input except USB (-> USB reset) */
 
   /* USB Reset by device only required on Watchdog Reset */
@@ -151,241 +530,1288 @@ static void hardwareInit(void) {
   DDRD = 0x02;    /* 0000 0010 bin: remove USB reset condition */
   /* configure timer 0 for a rate of 12M/(1024 * 256) = 45.78 Hz (~22ms) */
   TCCR0 = 5;      /* timer 0 prescaler: 1024 */
+  TCCR1B = 2;     /* timer 1 prescaler: 8 (0.67 us), the scheduler's clock */
 
-
-// Test LED Timer1
-TCCR1A = 0;
-TCCR1B = 0;
-TCNT1 = 0;
-OCR1A = 5000;
-TCCR1B |= (1 << WGM12);
-TCCR1B |= (1 << CS12) | (0 << CS11) | (0 << CS10);
-TIMSK |= (1 << OCIE1A);
+#ifdef RESTORE_ROW
+  MCUCR |= (1<<ISC10); /* INT1 (restore key) on any change */
+  GIFR = (1<<INTF1);
+  GICR |= (1<<INT1);
+#endif
 }
 
 uint8_t suspendFlag = 0 ;
+static uchar sofSeen;  /* usbSofCount at the last keep-alive seen */
+static uchar busStamp; /* TCNT0 at the last bus activity */
+volatile uchar sofStamp; /* TCNT0 at the last keep-alive (USB_SOF_HOOK) */
+static uchar inStamp;    /* TCNT0 when the last packet taken was seen */
 
-void sendRemoteWakeUp(void){
+/* Remote wakeup. The host allows it with SET_FEATURE(DEVICE_REMOTE_WAKEUP),
+   which the driver accepts without passing it on, so the setup packets
+   are snooped through USB_RX_USER_HOOK. A key pressed while suspended
+   drives the K state for ~10 ms, timed from TCNT0 by wakeupTask() while
+   the main loop keeps running; only the USB interrupt is held off. The
+   wakeup is signalled once per suspend, and the key is queued as usual,
+   to be sent when the host polls again. */
+#define WAKEUP_K 117 /* ~10 ms */
 
-	cli();
-	uint8_t ddr_init = USBDDR, port_init = USBOUT; 	// Get current direction register
-	USBDDR |= USBMASK; 						// D+ and D- as Output
+#define WAKEUP_IDLE 0 /* Armed */
+#define WAKEUP_K_STATE 1 /* Driving the K state */
+#define WAKEUP_DONE 2 /* Signalled, waiting for the bus to resume */
 
-	USBOUT |= (1<< USBMINUS); 				// D- high, D+ ist implizit Low, weil war high-impedance input ohne pullup
-	
-	// set k state
-	USBOUT ^= USBMASK; 						// D+ und D- werden invertiert
-	// wait
-	_delay_ms(10); 							// Pause 10ms
-	// set idle
-	USBOUT ^= USBMASK; 						// D+ und D- werden invertiert
+static uchar wakeupEnabled; /* Set by the host */
+static uchar wakeupRequest; /* A key was pressed */
+static uchar wakeupState;
+static uchar wakeupStamp; /* TCNT0 at the start of the K state */
 
-// revert ddr
-	USBDDR = ddr_init; 						// Reset direction register
-	// set port without pullup ie D+,D- = 0
-	//USBOUT &= ~( 1 << USBMINUS ); 			// D- int. Pullup deaktivieren
-	USBOUT = port_init;
+/* Called by the driver for every setup packet */
+void usbSetupSnoop(uchar *data) {
+  usbRequest_t *rq = (void *)data;
 
-	sei();
+  if (rq->bmRequestType==USBRQ_RCPT_DEVICE && rq->wValue.word==1) {
+    if (rq->bRequest==USBRQ_SET_FEATURE) wakeupEnabled=1;
+    else if (rq->bRequest==USBRQ_CLEAR_FEATURE) wakeupEnabled=0;
+  }
+}
 
+/* Called by the driver at the start and the end of a bus reset */
+void usbResetSeen(uchar resetStarts) {
+  if (resetStarts) stats.resets++;
+  wakeupEnabled=0;
 }
 
-uchar lastSOFcount = 0;
-volatile uchar standbyCounter = 0;
+static void wakeupTask(void) {
+  if (wakeupState==WAKEUP_IDLE) {
+    if (wakeupRequest && suspendFlag && wakeupEnabled) {
+      cli(); /* GICR is shared with the INT1 interrupt */
+      USB_INTR_ENABLE&=~(1<<USB_INTR_ENABLE_BIT); /* Our own K is no packet */
+      USBOUT=(USBOUT&~USBMASK)|(1<<USBPLUS);
+      USBDDR|=USBMASK;
+      sei();
+      wakeupStamp=TCNT0;
+      wakeupState=WAKEUP_K_STATE;
+    }
+  } else if (wakeupState==WAKEUP_K_STATE) {
+    if ((uchar)(TCNT0-wakeupStamp)>=WAKEUP_K) {
+      cli();
+      USBOUT^=USBMASK; /* J state, then release the lines to the pull-up */
+      USBDDR&=~USBMASK;
+      USBOUT&=~USBMASK;
+      USB_INTR_PENDING=1<<USB_INTR_PENDING_BIT;
+      USB_INTR_ENABLE|=1<<USB_INTR_ENABLE_BIT;
+      sei();
+      wakeupState=WAKEUP_DONE;
+    }
+  } else if (!suspendFlag) {
+    wakeupState=WAKEUP_IDLE; /* The bus is back, rearm */
+  }
+  wakeupRequest=0;
+}
+
+/* Row drive table. For every row of the matrix (and for the idle probe,
+   which drives all rows at once) it holds the row lines to drive low on
+   port B and on port D (the ROWS_D bits); the other row lines are inputs
+   with pull-ups. Port D is shared with USB and the LED, so it takes a
+   read-modify-write, which the rows on port B skip with ROWS_SAME: they
+   are only ever driven right after the row before, which leaves the port
+   D row lines as they are. A new wiring only needs a new table, the
+   scanner itself has no special cases. */
+typedef struct {
+  uchar ddrb; /* Row lines on port B */
+  uchar ddrd; /* Row lines on port D, or ROWS_SAME */
+} rowdrive_t;
+
+#define ROWS_D    0b00111000 /* PD3..PD5 may be row lines */
+#define ROWS_SAME 0xFF       /* Port D as for the row before */
+#define COLS_C    0b00111111 /* Column lines on port C... */
+#define COLS_D    0b11000000 /* ...and on port D */
+#define ALLROWS   SCANROWS   /* Table entry for the idle probe */
+
+const rowdrive_t rowdrive[SCANROWS+1] PROGMEM = {
+  {0x01, 0x00},      /* Row0: PB0 */
+  {0x02, ROWS_SAME}, /* Row1: PB1 */
+  {0x04, ROWS_SAME}, /* Row2: PB2 */
+  {0x08, ROWS_SAME}, /* Row3: PB3 */
+  {0x10, ROWS_SAME}, /* Row4: PB4 */
+  {0x20, ROWS_SAME}, /* Row5: PB5 */
+  {0x00, 0x10},      /* Row6: PD4 */
+  {0x00, 0x20},      /* Row7: PD5 */
+#ifdef PLUS4
+  {0x00, 0x08},      /* Row8: PD3 */
+  {0x3F, 0x38}       /* All rows */
+#else
+  {0x3F, 0x30}       /* All rows */
+#endif
+};
+
+
+/* Debounce one row of raw samples against the debounced state in
+   bitbuf[row]. Each key runs its own counter, which is cleared whenever
+   the raw sample agrees with the debounced state, so a key only changes
+   once it has read the same for DEBOUNCE scans in a row. In EAGER_PRESS
+   mode a press is taken at once and starts the lockout window instead.
+   Returns the mask of keys that changed state in this scan. */
+static uchar debounceRow(uchar row, uchar data) {
+  uchar delta, run, toggle, clear, restart, c0, c1, c2, c3;
 
-ISR(TIMER1_COMPA_vect) {
-// LED aus
-PORTD&=~0x02;
+  delta=data^bitbuf[row]; /* Keys that differ from the debounced state */
+  c0=vcnt0[row];
+  c1=vcnt1[row];
+  c2=vcnt2[row];
+  c3=vcnt3[row];
 
-standbyCounter++;
+#if EAGER_PRESS
+  uchar lock=vlock[row];
+  uchar press=delta&bitbuf[row]&~lock; /* New presses of unlocked keys */
+
+  delta&=~lock;  /* Locked keys ignore the matrix... */
+  run=delta|lock; /* ...but keep counting out their window */
+  clear=lock&VCNT_IS(LOCKOUT-1); /* Window has expired */
+  delta&=~press;
+  toggle=delta&VCNT_IS(DEBOUNCE-1); /* Integrated releases */
+  vlock[row]=(lock&~clear)|press;
+  toggle|=press;
+  clear|=toggle;
+#else
+  run=delta;
+  toggle=delta&VCNT_IS(DEBOUNCE-1); /* Keys that have settled now */
+  clear=toggle;
+#endif
+
+  /* Count the keys whose count is cut short by a bounce */
+  for (restart=(c0|c1|c2|c3)&~run;restart;restart&=restart-1) {
+    stats.restarts++;
+  }
 
+  /* Increment the running counters, clear all others */
+  c3=(c3^(c2&c1&c0))&run;
+  c2=(c2^(c1&c0))&run;
+  c1=(c1^c0)&run;
+  c0=~c0&run;
+
+  vcnt0[row]=c0&~clear;
+  vcnt1[row]=c1&~clear;
+  vcnt2[row]=c2&~clear;
+  vcnt3[row]=c3&~clear;
+  bitbuf[row]^=toggle;
+  return toggle;
 }
 
+/* Count the changes of state in a row, and quarantine the keys that
+   change too often. Returns true if a key has been quarantined. */
+static uchar countFlaps(uchar row, uchar toggle) {
+  uchar hit, c0, c1, c2, c3;
 
-/* Table for decoding bit positions of the last three rows */
-const char extrows[3] PROGMEM = { 0x10, 0x20, 0x08 };
+  c0=flap0[row];
+  c1=flap1[row];
+  c2=flap2[row];
+  c3=flap3[row];
+  hit=toggle&VCNT_IS(CHATTER_FLAPS-1);
+  c3^=c2&c1&c0&toggle;
+  c2^=c1&c0&toggle;
+  c1^=c0&toggle;
+  c0^=toggle;
+  flap0[row]=c0&~hit;
+  flap1[row]=c1&~hit;
+  flap2[row]=c2&~hit;
+  flap3[row]=c3&~hit;
+  hit&=~quarantine[row];
+  quarantine[row]|=hit;
+  return hit;
+}
 
+/* End of a chatter window: re-admit the quarantined keys that have been
+   released and quiet, and start counting again */
+static void chatterWindow(void) {
+  uchar row;
 
-/* This function scans the entire keyboard, debounces the keys, and
-   if a key change has been found, a new report is generated, and the
-   function returns true to signal the transfer of the report. */
-static uchar scankeys(void) {
-  uchar reportIndex=1; /* First available report entry is 2 */
-  uchar retval=0;
-  uchar row,data,key, modkeys;
-  volatile uchar col, mask;
-  static uchar debounce=5;
-
-  for (row=0;row<NUMROWS;++row) { /* Scan all rows */
-    DDRD&=~0b00111000; /* all 3 are input */
-    PORTD|=0b00111000; /* pull-up enable */
-    #ifdef PLUS4
-        if (row<6) {
-      data=pgm_read_byte(&modmask[row]);
-      DDRB=data;
-      PORTB=~data;
-    } else { // 3 extra rows are on PORTD
-      DDRB=0;
-      PORTB=0xFF;
-      data=pgm_read_byte(&extrows[row-6]);
-      DDRD|=data;
-      PORTD&=~data;
+  for (row=0;row<SCANROWS;++row) {
+    quarantine[row]&=~(bitbuf[row]&~(flap0[row]|flap1[row]|flap2[row]|flap3[row]));
+    flap0[row]=0;
+    flap1[row]=0;
+    flap2[row]=0;
+    flap3[row]=0;
+  }
+}
+
+/* Drive one row of the keyboard matrix low (or all rows, for ALLROWS),
+   leaving all other row lines as inputs with pull-ups */
+static inline void driveRow(uchar row) {
+  const rowdrive_t *r=&rowdrive[row];
+  uchar b=pgm_read_byte(&r->ddrb), d=pgm_read_byte(&r->ddrd);
+
+  DDRB=b;
+  PORTB=~b;
+  if (d!=ROWS_SAME) {
+    DDRD=(DDRD&~ROWS_D)|d;
+    PORTD=(PORTD&~ROWS_D)|(d^ROWS_D);
+  }
+}
+
+/* Read the columns of the row driven by driveRow(); all other bits read
+   as 1 */
+static inline uchar readCols(void) {
+  return (PINC|(uchar)~COLS_C)&(PIND|(uchar)~COLS_D);
+}
+
+/* Extra settling time (in us) for a driven row before it is read. The
+   scanner normally needs none, since a row is driven at the end of one
+   pass of the main loop and only read at the start of the next. */
+#define ROW_SETTLE_US 0
+
+/* Scanner state used while the keyboard is idle: all rows are driven
+   at once, and the full scan only resumes when a key is seen */
+#define SCAN_PROBE 0xFF
+
+#define SCAN_DECODE SCANROWS
+
+static uchar scanRow;     /* Row being driven, or SCAN_DECODE/SCAN_PROBE */
+static uchar scanChanged; /* Keys that settled during the current frame */
+static uchar scanBusy;    /* Keys pressed or bouncing during the frame */
+static uchar scanHit;     /* The probe has seen a key, scan at once */
+
+/* Frame schedule. With SCAN_SYNC set, the scanner runs one frame per USB
+   frame (1 ms, as timed by the keep-alives of the host), and starts it so
+   it ends just before the host's interrupt IN token, which makes the state
+   the host takes as fresh as possible. Both are measured: inPhase is the
+   time from the keep-alive to the moment a packet is taken, and scanTicks
+   the longest frame seen; the keep-alive is timed by the USB interrupt
+   (see USB_SOF_HOOK in usbconfig.h), the IN token by sendTask().
+   Without bus activity the frames run free. With SCAN_STATS set, the age
+   of the report state in every packet the host takes, from the moment it
+   was queued, is counted in scanAge[] (in bins of 1 << AGE_SHIFT timer 0
+   ticks of 85 us, the last bin holds all older ones), which is part of the
+   counters report. */
+#define SCAN_SYNC 1
+#define FRAME_TICKS 12 /* Timer 0 ticks per USB frame (11.7) */
+#define SCAN_MARGIN 1  /* Ticks from the end of a frame to the IN token */
+#define AGE_SHIFT 4    /* scanAge[] bins of 16 ticks (1.4 ms) */
+
+static uchar inPhase;     /* Ticks from the keep-alive to the IN token */
+static uchar scanTicks=1; /* Longest frame */
+static uchar scanFrame;   /* Keep-alive of the last frame started */
+static uchar scanStart;   /* TCNT0 at the start of the frame */
+
+/* Return true if the next frame may start now */
+static uchar frameDue(void) {
+  schar lead;
+
+  if (SCAN_SYNC && !suspendFlag) {
+    if (scanFrame==sofSeen) return 0; /* One frame per USB frame */
+    lead=inPhase-scanTicks-SCAN_MARGIN;
+    if (lead<0) lead+=FRAME_TICKS; /* End in the next USB frame */
+    if ((uchar)(TCNT0-busStamp)<(uchar)lead) return 0;
+    scanFrame=sofSeen;
+  }
+  scanStart=TCNT0;
+  statsFrames++;
+  return 1;
+}
+
+/* Called at the end of every frame */
+static void frameDone(void) {
+  uchar t=TCNT0-scanStart;
+
+  if (t>scanTicks && t<FRAME_TICKS) scanTicks=t;
+}
+
+/* Called when the host has taken a packet from the interrupt endpoint,
+   with the TCNT0 at which its report state was queued. The IN token is
+   not stamped in the interrupt, as the driver has no cycles to spare
+   before its reply, so inStamp is the pass that saw it: at most one pass
+   of the main loop (stats.worstLoop) late. */
+static void inSeen(uchar queued) {
+  uchar t=inStamp-sofStamp;
+
+  if ((schar)t<0) t+=FRAME_TICKS; /* A keep-alive came after the IN token */
+  if (t<FRAME_TICKS) inPhase=t;
+#if SCAN_STATS
+  t=(uchar)(inStamp-queued)>>AGE_SHIFT;
+  stats.scanAge[t<7?t:7]++;
+#endif
+}
+
+/* Start a new frame. An idle keyboard is watched with the all-rows probe,
+   otherwise the rows are scanned one by one. */
+static void startFrame(void) {
+  if (scanBusy) {
+    scanBusy=0;
+    scanRow=0;
+    driveRow(0);
+  } else {
+    scanRow=SCAN_PROBE;
+    driveRow(ALLROWS);
+  }
+}
+
+/* Ghost key blocking. Without diodes in the matrix, three keys down on
+   the corners of a rectangle make the fourth corner read as down too.
+   Whenever two rows share two or more pressed columns, the keys in those
+   columns are ambiguous: the ones already in the last report are kept,
+   new ones are held back until the rectangle is gone. The result goes to
+   state, and the function returns true if it differs from repbuf. */
+static uchar unghost(uchar *state) {
+  uchar block[SCANROWS];
+  uchar row, row2, down, shared, data, changed=0;
+
+  memset(block,0,sizeof(block));
+  for (row=0;row<SCANROWS;++row) {
+    down=~bitbuf[row];
+    if (!(down&(down-1))) continue; /* Less than two keys on this row */
+    for (row2=row+1;row2<SCANROWS;++row2) {
+      shared=down&~bitbuf[row2];
+      if (shared&(shared-1)) { /* Two or more shared columns */
+        block[row]|=shared&repbuf[row];
+        block[row2]|=shared&repbuf[row2];
+      }
+    }
+  }
+  for (row=0;row<NUMROWS;++row) {
+    data=bitbuf[row];
+    if (row<SCANROWS) data|=block[row]|quarantine[row];
+    changed|=data^repbuf[row];
+    state[row]=data;
+  }
+  return changed;
+}
+
+/* The keycodes of the report, kept in the order the keys were pressed
+   along with the matrix position (row*8+col) they came from. The report
+   is maintained incrementally: only keys that changed state are looked
+   up in the keymap, so the cost of an update depends on the number of
+   changed keys, not the number of held keys. */
+#define MAXKEYS 16              /* Keys held at once before rollover */
+#define BOOTKEYS 6              /* Keycodes in a boot protocol report */
+#define KEYPOS_SPECIAL 0x80     /* Flags keys that depend on the shifts */
+#define KEY_NEW 0x01            /* Keycode not in the last report yet */
+#define KEY_MUTED 0x02          /* Left out for a conflicting modifier */
+#define KEY_NKRO 0x04           /* In REPORT_ID_NKRO, not REPORT_ID_KEYS */
+
+static uchar keycodes[MAXKEYS]; /* Keycodes in the report */
+static uchar keypos[MAXKEYS];   /* Matrix position of each keycode */
+static uchar keymods[MAXKEYS];  /* Modifier changes of special keys */
+static uchar keyflags[MAXKEYS]; /* KEY_ flags of each keycode */
+static uchar keycount;          /* Number of keycodes in use */
+static uchar modbits;           /* Modifier keys held */
+static uchar rollover;          /* Number of keys that did not fit */
+
+/* The active keymap. It is chosen by pressing FN_KEY with a digit key (1
+   for the first keymap in KEYMAP_LIST and so on), or by holding the two
+   down while the keyboard is plugged in, and is kept in EEPROM. Keymap
+   KEYMAPS is the uploaded one, if there is a valid one. */
+static uchar kmIndex;                    /* Active keymap */
+static const unsigned char *kmKeys;      /* Its tables, from keymaps[] */
+static const unsigned int (*kmFn)[2];    /* (kmKeys may be kmUser) */
+static uchar kmFns;
+static uchar kmPlane;                    /* Offset of the shifted plane */
+static uchar kmRam;                      /* kmKeys is in RAM */
+static uchar kmChosen=0xFF;              /* Keymap chosen by the keys */
+static uint8_t kmSaved EEMEM=0xFF;       /* Keymap chosen last */
+static userkeymap_t kmUser;              /* Uploaded keymap */
+static uchar kmValid;                    /* kmUser holds a valid keymap */
+static userkeymap_t eeUser EEMEM;        /* Uploaded keymap in EEPROM */
+static uint16_t eeWrite=0xFFFF; /* Next byte for eeTask(), or 0xFFFF if idle */
+
+/* Make keymap n the active one */
+static void useKeymap(uchar n) {
+  const keymap_t *k=&keymaps[n<KEYMAPS?n:0];
+
+  kmIndex=n;
+  kmRam=(n==KEYMAPS);
+  if (kmRam) {
+    kmKeys=kmUser.keys;
+    kmPlane=USER_PLANE;
+  } else {
+    kmKeys=pgm_read_ptr(&k->keys);
+    kmPlane=KM_PLANE;
+  }
+  kmFn=pgm_read_ptr(&k->fn);
+  kmFns=pgm_read_byte(&k->fns);
+}
+
+/* Read a byte of the planes of the active keymap */
+static uchar kmRead(const unsigned char *p) {
+  return kmRam?*p:pgm_read_byte(p);
+}
+
+/* Return true if kmUser holds a complete keymap with the right checksum */
+static uchar userValid(void) {
+  uchar i;
+  uint16_t sum=0xFFFF;
+
+  if (kmUser.id!=REPORT_ID_KEYMAP || kmUser.id2!=REPORT_ID_SHIFTED) return 0;
+  for (i=0;i<KM_PLANE;++i) sum=_crc16_update(sum,kmUser.keys[i]);
+  for (i=0;i<KM_PLANE;++i) sum=_crc16_update(sum,kmUser.shifted[i]);
+  return sum==kmUser.sum;
+}
+
+/* Return the keymap chosen by the key at matrix position pos, i.e. the
+   number on its unshifted keycode, or 0xFF if it is no such digit */
+static uchar keymapDigit(uchar pos) {
+  uchar key=kmRead(kmKeys+2*pos), maps=KEYMAPS+kmValid;
+
+  if (maps<2 || key<KEY_1 || key>=KEY_1+maps) return 0xFF;
+  return key-KEY_1;
+}
+
+/* Choose the keymap at power-on: the one kept in EEPROM, unless FN_KEY
+   and a digit key were already down (and quarantined as stuck) */
+static void bootKeymap(void) {
+  uchar pos, n=eeprom_read_byte(&kmSaved);
+
+  eeprom_read_block(&kmUser,&eeUser,sizeof(kmUser));
+  kmValid=userValid();
+  useKeymap(n<KEYMAPS+kmValid?n:0);
+  if (!(quarantine[FN_KEY>>3]&(1<<(FN_KEY&7)))) return;
+  for (pos=0;pos<SCANROWS*8;++pos) {
+    if (quarantine[pos>>3]&(1<<(pos&7)) && (n=keymapDigit(pos))!=0xFF) {
+      useKeymap(n);
+      eeWrite=sizeof(kmUser); /* eeTask() keeps the choice */
+      return;
+    }
+  }
+}
+
+/* Look up the key at matrix position pos in the plane of the current
+   shift state. The modifier changes for the key are stored in *mods. */
+static uchar decodeKey(uchar pos, uchar *mods) {
+  const unsigned char *p=kmKeys+2*pos;
+  uchar shifted; /* A shift key is down (a 0 bit in repbuf) */
+
+#ifdef PLUS4
+  /* Lshift, or Rshift unless it is the key looked up */
+  shifted=!(repbuf[7]&0b00000010) || (!(repbuf[4]&0b01000000) && pos!=4*8+6);
+#elif defined(C16)
+  shifted=!(repbuf[7]&0b00000010); /* Both shifts are on this line */
+#else
+  shifted=!(repbuf[7]&0b00000010) || !(repbuf[4]&0b01000000); /* Lshift or Rshift */
+#endif
+  if (shifted) p+=kmPlane; /* Shifted plane, else the unshifted one */
+  *mods=kmRead(p+1);
+  return kmRead(p);
+}
+
+/* The control key held (only one is reported at a time), and the usage
+   in the last report sent for it */
+static uint16_t ctrlUsage;      /* Usage of the key held, or 0 */
+static uchar ctrlPos=0xFF;      /* Its matrix position */
+static uint16_t ctrlSent;       /* Usage in the last report on EP3 */
+static uchar ctrlReport[3];     /* Report ID and usage */
+
+/* FN_KEY is a modifier key too (C= is GUI or ALT), but its modifier is
+   held back while it is down until the chord is resolved: a key claimed
+   with it makes it an FN key for the rest of the hold, and its modifier
+   is never sent; any other key lets the modifier into the report first.
+   FN_KEY tapped alone is sent as a tap of its modifier on release. */
+#define FN_UP 0                 /* Not held (or not a modifier) */
+#define FN_HELD 1               /* Held alone, modifier held back */
+#define FN_CHORD 2              /* Held for a key it claimed */
+#define FN_MOD 3                /* Held as a modifier, in modbits */
+
+static uchar fnState;           /* FN_ state of FN_KEY */
+static uchar fnMods;            /* Its modifier bits */
+static uchar fnTap;             /* Modifier bits to tap in the next report */
+
+/* FN_KEY released */
+static void fnRelease(void) {
+  if (fnState==FN_HELD) fnTap=fnMods;
+  if (fnState==FN_MOD) modbits&=~fnMods;
+  fnState=FN_UP;
+}
+
+/* Claim the key at matrix position pos for the control interface, if it
+   is pressed with FN_KEY held and has an entry in fn_keys */
+static uchar claimCtrl(uchar pos) {
+  uchar i;
+
+  if (repbuf[FN_KEY>>3]&(1<<(FN_KEY&7))) return 0; /* FN_KEY is up */
+  for (i=0;i<kmFns;++i) {
+    if (pgm_read_word(&kmFn[i][0])==pos) {
+      ctrlUsage=pgm_read_word(&kmFn[i][1]);
+      ctrlPos=pos;
+      if (fnState==FN_HELD) fnState=FN_CHORD;
+      return 1;
     }
-    
-    #else
-    if (row<6) {
-      data=pgm_read_byte(&modmask[row]);
-      DDRB=data;
-      PORTB=~data;
-    } else if(row<8) { // 3 extra rows are on PORTD
-      DDRB=0;
-      PORTB=0xFF;
-      data=pgm_read_byte(&extrows[row-6]);
-      DDRD|=data;
-      PORTD&=~data;
-    } else { // special for row 8 (restore on c64)
-      DDRD&=~0x08;
-      PORTD|= 0x08;
+  }
+  return 0;
+}
+
+/* Claim the key at matrix position pos if it is a digit key pressed with
+   FN_KEY held, and choose the keymap of that number */
+static uchar claimKeymap(uchar pos) {
+  uchar n;
+
+  if (repbuf[FN_KEY>>3]&(1<<(FN_KEY&7))) return 0; /* FN_KEY is up */
+  if ((n=keymapDigit(pos))==0xFF) return 0;
+  kmChosen=n;
+  if (fnState==FN_HELD) fnState=FN_CHORD;
+  return 1;
+}
+
+/* Add the key at matrix position pos to the report */
+static void addKey(uchar pos) {
+  const unsigned char *p=kmKeys+2*pos;
+  uchar key=kmRead(p); /* Read keyboard map */
+  uchar mods=kmRead(p+1);
+
+  if (claimCtrl(pos)) return; /* Goes to the control interface */
+  if (claimKeymap(pos)) return; /* Chooses a keymap */
+  if (mods || kmRead(p+kmPlane)!=key || kmRead(p+kmPlane+1)) {
+    key=decodeKey(pos,&mods); /* Depends on the shift state */
+    pos|=KEYPOS_SPECIAL;
+  } else if (key>KEY_Modifiers && key<KEY_Special) { /* Modifier key? */
+    mods=pgm_read_byte(&modmask[key-(KEY_Modifiers+1)]);
+    if (pos==FN_KEY) { /* Held back, see fnState */
+      fnMods=mods;
+      if (fnState==FN_UP) fnState=FN_HELD;
+      if (fnState!=FN_MOD) return;
     }
-    #endif
-    
-    _delay_us(30); /* Used to be small loop, but the compiler optimized it away ;-) */
-  #ifdef PLUS4 
-     data=(PINC&0x3F)|(PIND&0xC0);
-     #else
-         if(row<8) {
-      data=(PINC&0x3F)|(PIND&0xC0);
+    modbits|=mods;
+    return;
+  }
+  if (!key) return;
+  if (fnState==FN_HELD) { /* FN_KEY is a modifier for this one */
+    fnState=FN_MOD;
+    modbits|=fnMods;
+  }
+  if (keycount>=MAXKEYS) { /* Too many keycodes - rollOver */
+    rollover++;
+    stats.rollovers++;
+    return;
+  }
+  keycodes[keycount]=key; /* Set next available entry */
+  keypos[keycount]=pos;
+  keymods[keycount]=mods;
+  keyflags[keycount]=KEY_NEW;
+  keycount++;
+}
+
+/* Return the entry of the key at matrix position pos, or 0xFF if it is
+   not in the key list */
+static uchar findKey(uchar pos) {
+  uchar i;
+
+  for (i=0;i<keycount;++i) {
+    if ((keypos[i]&~KEYPOS_SPECIAL)==pos) return i;
+  }
+  return 0xFF;
+}
+
+/* Remove entry i of the key list. The keys pressed after it move down
+   one entry, so the order stays stable. */
+static void dropKey(uchar i) {
+  keycount--;
+  memmove(keycodes+i,keycodes+i+1,keycount-i);
+  memmove(keypos+i,keypos+i+1,keycount-i);
+  memmove(keymods+i,keymods+i+1,keycount-i);
+  memmove(keyflags+i,keyflags+i+1,keycount-i);
+}
+
+/* Remove the key at matrix position pos from the report */
+static void removeKey(uchar pos) {
+  uchar key=kmRead(kmKeys+2*pos);
+  uchar i;
+
+  if (pos==ctrlPos) { /* Control key released */
+    ctrlPos=0xFF;
+    ctrlUsage=0;
+    return;
+  }
+  if (pos==FN_KEY) fnRelease();
+  if (key>KEY_Modifiers && key<KEY_Special) { /* No keymap maps two keys to the same modifier */
+    modbits&=~pgm_read_byte(&modmask[key-(KEY_Modifiers+1)]);
+    return;
+  }
+  if ((i=findKey(pos))!=0xFF) dropKey(i);
+}
+
+/* Decode the whole matrix in repbuf again, e.g. with a new keymap. The
+   keys already in the list are looked up again in turn, oldest first, so
+   they keep their order and their flags (the report they are in, and
+   whether they are muted); the other keys down are added after them. */
+static void rebuildKeys(void) {
+  uchar row, col, data, i, n=keycount, pos, key, flags;
+
+  rollover=0;
+  modbits=0;
+  if (repbuf[FN_KEY>>3]&(1<<(FN_KEY&7))) fnRelease(); /* FN_KEY is up */
+  ctrlPos=0xFF;
+  ctrlUsage=0;
+  for (i=0;i<n;++i) {
+    pos=keypos[0]&~KEYPOS_SPECIAL;
+    key=keycodes[0];
+    flags=keyflags[0];
+    dropKey(0);
+    if (repbuf[pos>>3]&(1<<(pos&7))) continue; /* Released */
+    addKey(pos);
+    if (keycount && (keypos[keycount-1]&~KEYPOS_SPECIAL)==pos) {
+      if (keycodes[keycount-1]!=key) flags|=KEY_NEW;
+      keyflags[keycount-1]=flags;
     }
-    else {
-      
-      if((PIND & 0x08) == 0) {
-        data = ~(0x08);
-      } else {
-        data = 0xFF;
+  }
+  for (row=0;row<NUMROWS;++row) { /* Process all rows for key-codes */
+    data=repbuf[row];
+    if (data!=0xFF) { /* Anything on this row? - optimization */
+      for (col=0;col<8;++col) { /* yes - check individual bits */
+        if (!(data&1) && findKey(row*8+col)==0xFF) addKey(row*8+col); /* Key detected */
+        data>>=1;
       }
-     
-    }
-      #endif
-    if (data^bitbuf[row]) { 
-      debounce=20; /* If a change was detected, activate debounce counter */ // ge�ndert auf 20, damit weniger doppelbuchstaben kommen, von 10 auf 20
     }
-    bitbuf[row]=data; /* Store the result */
-  }
-
-  if (debounce==1) { /* Debounce counter expired */
-    modkeys=0;
-    memset(reportBuffer,0,sizeof(reportBuffer)); /* Clear report buffer */
-    for (row=0;row<NUMROWS;++row) { /* Process all rows for key-codes */
-      data=bitbuf[row]; /* Restore buffer */
-      
-      if (data!=0xFF) { /* Anything on this row? - optimization */
-        for (col=0,mask=1;col<8;++col,mask<<=1) { /* yes - check individual bits */
-          if (!(data&mask)) { /* Key detected */
-            key=pgm_read_byte(&keymap[row][col]); /* Read keyboard map */
-
-// LED AN
-TCNT1 = 0; // Reset Timer1 Counter
-PORTD|=0x02;
-
-if(suspendFlag == 1)
-{
-
-sendRemoteWakeUp();
-
-}
-// TODO: Danach noch Taste senden? Kommt evtl. nicht an....
-
-
-            if (key>KEY_Special) { /* Special handling of shifted keys */
-              /* Modifiers have not been decoded yet - handle manually */
-              uchar keynum=key-(KEY_Special+1);
-              #ifdef PLUS4
-              if (((bitbuf[4]&0b01000000) || (key >=SPC_grave))&& /* Rshift */
-                   ((bitbuf[7]&0b00000010))) {/* Lshift */ // war ((bitbuf[7]&0b00000010)||(key>=SPC_crsrud))) aus irgendeinem Grund....
-              #elif defined(C16)
-                if (bitbuf[7]&0b00000010) {/* Both shifts */
-              #else
-              if ((bitbuf[4]&0b01000000)&& /* Rshift */
-                   ((bitbuf[7]&0b00000010))) {/* Lshift */ // war ((bitbuf[7]&0b00000010)||(key>=SPC_crsrud))) aus irgendeinem Grund....
-              #endif
-                key=pgm_read_byte(&spec_keys[keynum][0]); /* Unmodified */
-                modkeys=pgm_read_byte(&spec_keys[keynum][1]);
-              } else {
-                key=pgm_read_byte(&spec_keys[keynum][2]); /* Shifted */
-                modkeys=pgm_read_byte(&spec_keys[keynum][3]);
-              }
-            } else if (key>KEY_Modifiers) { /* Is this a modifier key? */
-              reportBuffer[0]|=pgm_read_byte(&modmask[key-(KEY_Modifiers+1)]);
-              key=0;
-            }
-            if (key) { /* Normal keycode should be added to report */
-              if (++reportIndex>=sizeof(reportBuffer)) { /* Too many keycodes - rollOver */
-                if (!retval&0x02) { /* Only fill buffer once */
-                  memset(reportBuffer+2, KEY_errorRollOver, sizeof(reportBuffer)-2);
-                  retval|=2; /* continue decoding to get modifiers */
-                }
-              } else {
-                reportBuffer[reportIndex]=key; /* Set next available entry */
-              }
-            }
-          }
+  }
+}
+
+/* Switch to the keymap chosen by the keys, if it is a new one */
+static void switchKeymap(void) {
+  uchar n=kmChosen;
+
+  kmChosen=0xFF;
+  if (n==0xFF || n==kmIndex) return;
+  useKeymap(n);
+  if (eeWrite==0xFFFF) eeWrite=sizeof(kmUser); /* eeTask() keeps the choice */
+  rebuildKeys(); /* The keys held mean something else now */
+  kmChosen=0xFF;
+}
+
+/* Bring the report up to date with the new matrix state. Only the keys
+   that differ from repbuf (the matrix behind the last report) are added
+   or removed. */
+static void updateKeys(uchar *state) {
+  uchar diff[NUMROWS];
+  uchar row, col, data, i, mods, pressed=0, released=0;
+
+  for (row=0;row<NUMROWS;++row) {
+    diff[row]=state[row]^repbuf[row];
+    pressed|=diff[row]&repbuf[row];
+    released|=diff[row]&state[row];
+    repbuf[row]=state[row];
+  }
+
+  if (pressed) {
+    wakeupRequest=1;
+    ledFlash=LED_FLASH;
+  }
+
+  if (rollover && released) { /* A key that did not fit may fit now */
+    rebuildKeys();
+    switchKeymap();
+    return;
+  }
+
+  for (row=0;row<NUMROWS;++row) {
+    data=diff[row];
+    for (col=0;data;++col,data>>=1) {
+      if (data&1) {
+        if (state[row]&(1<<col)) {
+          removeKey(row*8+col);
+        } else {
+          addKey(row*8+col);
         }
       }
     }
-    if (modkeys&0x80) { /* Clear RSHIFT */
-      reportBuffer[0]&=~0x20;
+  }
+
+  if ((diff[4]&0b01000000)||(diff[7]&0b00000010)) {
+    /* Shift state has changed - look up held special keys again */
+    for (i=0;i<keycount;++i) {
+      if (keypos[i]&KEYPOS_SPECIAL) {
+        data=keypos[i]&~KEYPOS_SPECIAL;
+        data=decodeKey(data,&mods);
+        if (data!=keycodes[i]) keyflags[i]|=KEY_NEW;
+        keycodes[i]=data;
+        keymods[i]=mods;
+      }
+    }
+  }
+  switchKeymap();
+}
+
+/* The modifier byte a key with the modifier changes mods needs */
+static uchar keyModifiers(uchar mods) {
+  uchar m=modbits;
+
+  if (mods&0x80) { /* Clear RSHIFT */
+    m&=~0x20;
+  }
+  if (mods&0x08) { /* Clear LSHIFT */
+    m&=~0x02;
+  }
+  return m|(mods&0x77); /* Set other modifiers */
+}
+
+/* Fill reportBuffer from the key list, in the format of the current
+   protocol. The most recently pressed key decides the modifier byte, and
+   the older keys that need another one are muted: they are left out of
+   the report until released, since they have been typed already. If that
+   changes the modifier byte, the report that releases them under the old
+   one is built first and true is returned; the caller queues it and calls
+   again for the report with the new state. A tap of FN_KEY alone gets a
+   report of its own the same way. In report protocol, the keys
+   that find REPORT_ID_KEYS full are put in REPORT_ID_NKRO for good. The
+   keycodes are at offset 2 in both protocols, the modifier byte is
+   reportBuffer[protocolVer]. */
+static uchar buildReport(void) {
+  uchar i, key, m, mods=modbits, skip=KEY_MUTED, found=0, muted=0, n=0;
+
+  for (i=keycount;i--;) { /* Newest first */
+    if (keyflags[i]&KEY_MUTED) continue;
+    m=keyModifiers(keymods[i]);
+    if (!found) {
+      found=1;
+      mods=m;
+    } else if (m!=mods) {
+      keyflags[i]|=KEY_MUTED;
+      muted=1;
+    }
+  }
+  if (muted && mods!=reportBuffer[protocolVer]) { /* Release the muted keys first */
+    mods=reportBuffer[protocolVer];
+    skip|=KEY_NEW;
+  } else if (fnTap) { /* Its modifier down here, up in the next one */
+    mods|=fnTap;
+    fnTap=0;
+    skip|=KEY_NEW;
+    muted=1;
+  } else {
+    muted=0;
+    for (i=0;i<keycount;++i) keyflags[i]&=~KEY_NEW;
+  }
+
+  memset(reportBuffer,0,sizeof(reportBuffer));
+  reportBuffer[protocolVer]=mods;
+  if (protocolVer) {
+    reportBuffer[0]=REPORT_ID_KEYS;
+    reportBuffer[KEYS_REPORT]=REPORT_ID_NKRO;
+  }
+  for (i=0;i<keycount;++i) {
+    if (keyflags[i]&skip) continue;
+    key=keycodes[i];
+    if (!protocolVer) { /* Boot protocol */
+      if (n<BOOTKEYS) reportBuffer[2+n]=key;
+      n++;
+    } else if (!(keyflags[i]&KEY_NKRO) && n<REPORT_KEYS) { /* Report protocol */
+      reportBuffer[2+n]=key;
+      n++;
+    } else { /* One bit per usage */
+      keyflags[i]|=KEY_NKRO;
+      if (key<NKRO_KEYS) {
+        reportBuffer[KEYS_REPORT+1+(key>>3)]|=pgm_read_byte(&modmask[key&7]);
+      }
+    }
+  }
+  if (!protocolVer && (rollover || n>BOOTKEYS)) {
+    memset(reportBuffer+2, KEY_errorRollOver, BOOTKEYS);
+  }
+  return muted;
+}
+
+/* Size of the keyboard reports in the current protocol */
+static uchar reportSize(void) {
+  return protocolVer?sizeof(reportBuffer):BOOT_REPORT;
+}
+
+/* Size of the keys part: REPORT_ID_KEYS, or the whole boot report */
+static uchar keysSize(void) {
+  return protocolVer?KEYS_REPORT:BOOT_REPORT;
+}
+
+/* Power-on self test: quarantine every key that is already down before
+   anybody could have pressed it, i.e. stuck. */
+static void stuckKeyTest(void) {
+  uchar row;
+
+  for (row=0;row<SCANROWS;++row) {
+    driveRow(row);
+    _delay_us(30);
+    quarantine[row]=~readCols();
+  }
+}
+
+#ifdef RESTORE_ROW
+/* The restore key is on INT1. The first edge takes the key down at once
+   if it was up; the line is then ignored for RESTORE_LOCKOUT ticks of
+   timer 0 (85.3 us each), after which its level is taken as the state of
+   the key and the interrupt is enabled again. */
+#define RESTORE_LOCKOUT 59 /* ~5 ms */
+
+static volatile uchar restoreEdge; /* Set by the INT1 interrupt */
+static uchar restoreLocked;        /* Lockout window is running */
+static uchar restoreStamp;         /* TCNT0 at the start of the window */
+
+ISR(INT1_vect, ISR_NOBLOCK) {
+  GICR&=~(1<<INT1); /* Ignore the bounces until the lockout is over */
+  restoreEdge=1;
+}
+
+/* Set the state of the restore key, and have the scanner decode it */
+static void restoreSet(uchar data) {
+  if (data!=bitbuf[RESTORE_ROW]) {
+    bitbuf[RESTORE_ROW]=data;
+    scanChanged=1;
+  }
+}
+
+/* Take the restore key edges from the interrupt, and end the lockout */
+static void restoreTask(void) {
+  if (restoreEdge) {
+    restoreEdge=0;
+    restoreLocked=1;
+    restoreStamp=TCNT0;
+    restoreSet(0xFF&~0x08); /* A press is taken on the first edge */
+  } else if (restoreLocked && (uchar)(TCNT0-restoreStamp)>=RESTORE_LOCKOUT) {
+    restoreLocked=0;
+    restoreSet((PIND&0x08)?0xFF:(uchar)~0x08);
+    GIFR=1<<INTF1; /* Drop the edges seen during the lockout */
+    GICR|=1<<INT1;
+  }
+}
+#endif
+
+/* This function scans the keyboard one row per call, so usbPoll() gets
+   to run between the rows. Each call reads and debounces the row driven
+   by the previous call and drives the next one. When a full frame has
+   been scanned and a key has settled in a new state, the following call
+   updates the report, and the function returns true to signal the
+   transfer of the report. */
+static uchar scankeys(void) {
+  uchar state[NUMROWS];
+  uchar data, key;
+
+#if ROW_SETTLE_US
+  _delay_us(ROW_SETTLE_US);
+#endif
+#ifdef RESTORE_ROW
+  restoreTask();
+#endif
+  if (scanRow==SCAN_PROBE) { /* Idle - only look for a key going down */
+    if (scanChanged) { /* Restore key - decode in the next call */
+      scanRow=SCAN_DECODE;
+    } else if (frameDue()) {
+      if (readCols()!=0xFF) { /* The probe took the frame slot */
+        scanBusy=1;
+        scanHit=1;
+        startFrame();
+      } else {
+        frameDone();
+      }
+    }
+    return 0;
+  }
+
+  if (scanRow==0) { /* Wait for the next frame, unless the probe hit */
+    if (!scanHit && !frameDue()) return 0;
+    scanHit=0;
+  }
+
+  if (scanRow<SCANROWS) { /* Scan step */
+    data=readCols();
+    key=debounceRow(scanRow,data);
+    scanChanged|=key|countFlaps(scanRow,key);
+    scanBusy|=(uchar)~(data&bitbuf[scanRow]);
+    if (++scanRow<SCANROWS) {
+      driveRow(scanRow);
+    } else if (!scanChanged) { /* Otherwise decode in the next call */
+      frameDone();
+      startFrame();
     }
-    if (modkeys&0x08) { /* Clear LSHIFT */
-      reportBuffer[0]&=~0x02;
+    return 0;
+  }
+
+  /* Decode step - start the next frame first, so its first row settles
+     while the report is generated */
+  scanChanged=0;
+  startFrame();
+
+  if (!unghost(state)) { /* Nothing to report after ghost blocking */
+    return 0;
+  }
+  updateKeys(state);
+  frameDone();
+  return 1; /* A key has changed state, so send the new report */
+}
+
+/* Queue of report states waiting for the interrupt endpoint. Every
+   distinct state the decoder produces is sent to the host in turn, one
+   per interrupt IN poll, so a key tapped between two polls is not lost.
+   If the queue is full, the newest entry is replaced by the new state (so
+   the host always ends up with the current state), and the overflow is
+   counted in stats.suppressed. In report protocol an entry holds both
+   reports, but only those that differ from the entry before it are sent
+   (queueParts), REPORT_ID_KEYS first, so the modifiers are in place
+   before a key in REPORT_ID_NKRO. A report longer than 8 bytes is sent in
+   several interrupt packets, and the entry stays in the queue until the
+   last one has gone. */
+#define REPORT_QUEUE 4 /* Entries, must be a power of two */
+#define PART_KEYS 0x01 /* REPORT_ID_KEYS (or the boot report) changed */
+#define PART_NKRO 0x02 /* REPORT_ID_NKRO changed */
+#define PART_ALL  0x03
+
+static uchar reportQueue[REPORT_QUEUE][sizeof(reportBuffer)];
+static uchar queueParts[REPORT_QUEUE]; /* PART_ bits of each entry */
+static uchar queueStamp[REPORT_QUEUE]; /* TCNT0 when each was queued */
+static uchar packetStamp;    /* queueStamp of the packet waiting */
+static uchar queueHead;      /* Oldest entry */
+static uchar queueLen;       /* Entries waiting */
+static uchar queueSent;      /* Bytes of the oldest entry already sent */
+static uchar packetWaiting;  /* A packet is waiting for the host */
+
+/* Add the state in reportBuffer to the queue, unless it is the same as
+   the last state queued (or sent, since a sent entry stays in place).
+   The reports in force (PART_ bits) are queued in any case. An entry
+   that replaces the newest one takes over its parts too. */
+static void queueReport(uchar force) {
+  uchar i=(queueHead+queueLen-1)&(REPORT_QUEUE-1), parts=0;
+  uchar *slot=reportQueue[i];
+
+  if ((force&PART_KEYS) || memcmp(slot,reportBuffer,keysSize())) parts=PART_KEYS;
+  if (protocolVer && ((force&PART_NKRO) || memcmp(slot+KEYS_REPORT,reportBuffer+KEYS_REPORT,NKRO_REPORT))) {
+    parts|=PART_NKRO;
+  }
+  if (!parts) return;
+  if (queueLen<REPORT_QUEUE) {
+    i=(i+1)&(REPORT_QUEUE-1);
+    queueParts[i]=0;
+    queueLen++;
+  } else {
+    stats.suppressed++;
+  }
+  queueParts[i]|=parts;
+  queueStamp[i]=TCNT0;
+  memcpy(reportQueue[i],reportBuffer,sizeof(reportBuffer));
+}
+
+/* Build and queue the report of the keys held, after the one releasing
+   muted keys if there is one (see buildReport()) */
+static void queueKeys(uchar force) {
+  while (buildReport()) queueReport(0);
+  queueReport(force);
+}
+
+/* Send the next packet of the oldest queued entry */
+static void sendReport(void) {
+  uchar parts=queueParts[queueHead], keys=keysSize(), len;
+
+  if (queueSent<keys && !(parts&PART_KEYS)) queueSent=keys;
+  len=(queueSent<keys?keys:reportSize())-queueSent;
+  if (len>8) len=8;
+  usbSetInterrupt(reportQueue[queueHead]+queueSent, len);
+  packetWaiting=1;
+  packetStamp=queueStamp[queueHead];
+  stats.sent++;
+  queueSent+=len;
+  if (queueSent==keys && !(parts&PART_NKRO)) queueSent=reportSize();
+  if (queueSent>=reportSize()) {
+    if (parts&PART_KEYS) idleReset(IDLE_KEYS);
+    if (parts&PART_NKRO) idleReset(IDLE_NKRO);
+    queueSent=0;
+    queueHead=(queueHead+1)&(REPORT_QUEUE-1);
+    queueLen--;
+  }
+}
+
+/* Put usage in ctrlReport, with the report ID of its page */
+static void ctrlFill(uint16_t usage) {
+  ctrlReport[0]=(usage&SYSTEM_CTRL)?REPORT_ID_SYSTEM:REPORT_ID_CONSUMER;
+  ctrlReport[1]=usage;
+  ctrlReport[2]=(usage&~SYSTEM_CTRL)>>8;
+}
+
+#ifdef JOYSTICK
+/* The joysticks are sampled on every pass of the main loop, far more
+   often than the keyboard matrix, and every line is debounced on its own:
+   a change is taken at once, and the line then ignores its bounces for
+   JOY_LOCKOUT. The lines of port 1 are bits 0..4 of joyState, port 2 is
+   bits 5..9, in the order up, down, left, right, fire (1 = active). */
+#define JOY_LINES   10
+#define JOY_LOCKOUT 23 /* ~2 ms */
+#define JOY_UP      0x01
+#define JOY_DOWN    0x02
+#define JOY_LEFT    0x04
+#define JOY_RIGHT   0x08
+#define JOY_FIRE    0x10
+
+static uint16_t joyState;         /* Debounced lines */
+static uint16_t joyLocked;        /* Lines ignoring their bounces */
+static uchar joyStamp[JOY_LINES]; /* TCNT0 at the last change of a line */
+static uint16_t joySent;          /* Lines in the last report */
+static uchar joyReport[6];        /* Report ID, X, Y, Z, Rz, fire */
+
+static void joyTask(void) {
+  uint16_t lines=(uchar)~PINA|((uint16_t)(uchar)(~PINB&0xC0)<<2);
+  uint16_t bit, change;
+  uchar i, now=TCNT0;
+
+  if (joyLocked) { /* End the lockout of lines whose window is over */
+    for (i=0,bit=1;i<JOY_LINES;++i,bit<<=1) {
+      if ((joyLocked&bit) && (uchar)(now-joyStamp[i])>=JOY_LOCKOUT) {
+        joyLocked&=~bit;
+      }
     }
-    reportBuffer[0]|=modkeys&0x77; /* Set other modifiers */
+  }
+  change=(lines^joyState)&~joyLocked;
+  if (!change) return;
+  joyState^=change;
+  joyLocked|=change;
+  for (i=0,bit=1;i<JOY_LINES;++i,bit<<=1) {
+    if (change&bit) joyStamp[i]=now;
+  }
+}
 
-    retval|=1; /* Must have been a change at some point, since debounce is done */
+/* Lines of one port */
+static uchar joyLines(uchar port) {
+  return (joyState>>(port*5))&0x1F;
+}
+
+/* Put the state of both ports in joyReport */
+static void joyFill(void) {
+  uchar port, lines;
+
+  joyReport[0]=REPORT_ID_JOY;
+  joyReport[5]=0;
+  for (port=0;port<2;++port) {
+    lines=joyLines(port);
+    joyReport[1+2*port]=(lines&JOY_LEFT)?-127:(lines&JOY_RIGHT)?127:0;
+    joyReport[2+2*port]=(lines&JOY_UP)?-127:(lines&JOY_DOWN)?127:0;
+    if (lines&JOY_FIRE) joyReport[5]|=1<<port;
   }
-  if (debounce) debounce--; /* Count down, but avoid underflow */
-  return retval;
 }
 
-uchar expectReport=0;
+/* Send the joystick report if a port has changed. Returns true if it was
+   sent. */
+static uchar joySend(void) {
+  if (joyState==joySent) return 0;
+  joySent=joyState;
+  joyFill();
+  usbSetInterrupt3(joyReport,sizeof(joyReport));
+  idleReset(REPORT_ID_JOY);
+  return 1;
+}
+#endif
+
+/* Fill the input report with ID id of the control interface from the
+   current state. Returns its size, and the buffer in *buf. */
+static uchar ctrlGet(uchar id, uchar **buf) {
+#ifdef JOYSTICK
+  if (id==REPORT_ID_JOY) {
+    joyFill();
+    *buf=joyReport;
+    return sizeof(joyReport);
+  }
+#endif
+  if (id==REPORT_ID_SYSTEM) {
+    ctrlFill((ctrlUsage&SYSTEM_CTRL)?ctrlUsage:SYSTEM_CTRL);
+  } else {
+    ctrlFill((ctrlUsage&SYSTEM_CTRL)?0:ctrlUsage);
+  }
+  *buf=ctrlReport;
+  return sizeof(ctrlReport);
+}
+
+/* Send the state of the control keys (and joysticks, which go first) on
+   EP3 when it has changed. When the key held moves to the other page, the
+   release of the old one is sent first. Reports whose idle time is over
+   are repeated when nothing has changed. */
+static void ctrlTask(void) {
+  uint16_t usage=ctrlUsage;
+  uchar id, len, *buf;
+
+  if (!usbInterruptIsReady3()) return;
+#ifdef JOYSTICK
+  if (joySend()) return;
+#endif
+  if (usage==ctrlSent) {
+    for (id=1;id<IDLE_REPORTS;++id) {
+      if (idleDue&(1<<id)) {
+        len=ctrlGet(id,&buf);
+        usbSetInterrupt3(buf,len);
+        idleReset(id);
+        return;
+      }
+    }
+    return;
+  }
+  if (ctrlSent && ((usage^ctrlSent)&SYSTEM_CTRL)) {
+    usage=ctrlSent&SYSTEM_CTRL; /* Release on the old page */
+  }
+  ctrlFill(usage);
+  ctrlSent=(usage&~SYSTEM_CTRL)?usage:0;
+  usbSetInterrupt3(ctrlReport,sizeof(ctrlReport));
+  idleReset(ctrlReport[0]);
+}
+
+/* Switch between boot (0) and report (1) protocol. Reports queued in the
+   old format are dropped, and the current state is queued in the new. */
+static void setProtocol(uchar protocol) {
+  protocolVer=protocol;
+  queueLen=0;
+  queueSent=0;
+  queueKeys(PART_ALL);
+}
+
+uchar expectReport=0; /* 1: LED report, 2: keymap (see keymapWrite()) */
+
+/* Upload of a keymap, as the unshifted plane (REPORT_ID_KEYMAP) and then
+   the shifted one with the checksum (REPORT_ID_SHIFTED). kmUser is the
+   receive buffer, so the uploaded keymap is left while it is received;
+   once the shifted plane is in and the checksum is right it is chosen at
+   once, and eeTask() writes it to EEPROM in the background. Otherwise,
+   or if the upload stops for KM_TIMEOUT seconds, the old one is read back
+   and chosen again if it was in use. */
+#define KM_TIMEOUT 2            /* Seconds to wait for the rest of an upload */
+
+static uchar *kmRecv;           /* Where the next bytes of the report go */
+static uchar kmLeft;            /* Bytes of the report still to come */
+static uchar kmResume;          /* The uploaded keymap was in use */
+static uchar kmWait;            /* Seconds left for the upload, or 0 */
+
+/* Read the keymap in EEPROM back into kmUser, after an upload that failed */
+static void keymapRestore(void) {
+  kmWait=0;
+  eeprom_read_block(&kmUser,&eeUser,sizeof(kmUser));
+  kmValid=userValid();
+  if (kmValid && kmResume) {
+    useKeymap(KEYMAPS);
+    rebuildKeys();
+    queueKeys(0);
+  }
+  kmResume=0;
+}
+
+static uchar keymapWrite(uchar *data, uchar len) {
+  if (eeWrite<sizeof(kmUser)) { /* Still writing the last one */
+    expectReport=0;
+    return 0xFF;
+  }
+  kmWait=KM_TIMEOUT;
+  if (kmValid) {
+    kmValid=0;
+    if (kmRam) {
+      kmResume=1;
+      useKeymap(0);
+      rebuildKeys();
+    }
+  }
+  if (len>kmLeft) len=kmLeft;
+  memcpy(kmRecv,data,len);
+  kmRecv+=len;
+  kmLeft-=len;
+  if (kmLeft) return 0; /* More to come */
+  expectReport=0;
+  if (kmRecv!=(uchar *)(&kmUser+1)) return 1; /* Wait for the shifted plane */
+  if (!userValid()) {
+    keymapRestore();
+    return 0xFF; /* STALL */
+  }
+  kmWait=0;
+  kmResume=0;
+  kmValid=1;
+  useKeymap(KEYMAPS);
+  rebuildKeys();
+  queueKeys(0);
+  eeWrite=0;
+  return 1;
+}
+
+/* Give up an upload that stopped half way */
+static void uploadTask(void) {
+  if (kmWait && !--kmWait) keymapRestore();
+}
 
 uchar usbFunctionSetup(uchar data[8]) {
   usbRequest_t *rq = (void *)data;
+  uchar id = rq->wValue.bytes[0], len, *buf;
   usbMsgPtr = reportBuffer;
+  if(rq->wIndex.bytes[0] == CTRL_INTERFACE){ /* Control keys: input only */
+    if((rq->bmRequestType & USBRQ_TYPE_MASK) != USBRQ_TYPE_CLASS){
+      return 0;
+    }
+    if(rq->bRequest == USBRQ_HID_GET_REPORT){
+      /* wValue: ReportType (highbyte), ReportID (lowbyte) */
+      if(id == REPORT_ID_STATS){
+        statsReport = stats;
+        stats.worstLoop = 0;
+        memset(stats.taskWorst, 0, sizeof(stats.taskWorst));
+        usbMsgPtr = (usbMsgPtr_t)&statsReport;
+        return sizeof(statsReport);
+      }
+      if(id == REPORT_ID_KEYMAP){
+        usbMsgPtr = (usbMsgPtr_t)&kmUser.id;
+        return 1+KM_PLANE;
+      }
+      if(id == REPORT_ID_SHIFTED){
+        usbMsgPtr = (usbMsgPtr_t)&kmUser.id2;
+        return 1+KM_PLANE+2;
+      }
+      len = ctrlGet(id, &buf);
+      usbMsgPtr = (usbMsgPtr_t)buf;
+      return len;
+    }else if(rq->bRequest == USBRQ_HID_SET_REPORT){
+      if(id == REPORT_ID_KEYMAP && rq->wLength.word == 1+KM_PLANE){
+        kmRecv = &kmUser.id;
+      }else if(id == REPORT_ID_SHIFTED && rq->wLength.word == 1+KM_PLANE+2){
+        kmRecv = &kmUser.id2;
+      }else{
+        return 0;
+      }
+      kmLeft = rq->wLength.bytes[0];
+      expectReport = 2;
+      return 0xFF; /* Call usbFunctionWrite with data */
+    }else if(rq->bRequest == USBRQ_HID_GET_IDLE){
+      usbMsgPtr = &idleRate[(id && id < IDLE_REPORTS) ? id : 1];
+      return 1;
+    }else if(rq->bRequest == USBRQ_HID_SET_IDLE){ /* ID 0 sets all */
+      for(id = 1; id < IDLE_REPORTS; ++id){
+        if(!rq->wValue.bytes[0] || rq->wValue.bytes[0] == id){
+          idleRate[id] = rq->wValue.bytes[1];
+          idleReset(id);
+        }
+      }
+    }
+    return 0;
+  }
   if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS){    /* class request type */
     if(rq->bRequest == USBRQ_HID_GET_REPORT){  
       /* wValue: ReportType (highbyte), ReportID (lowbyte) */
-      /* we only have one report type, so don't look at wValue */
-      return sizeof(reportBuffer);
+      if(!protocolVer){
+        return BOOT_REPORT;
+      }
+      if(id == REPORT_ID_NKRO){
+        usbMsgPtr = reportBuffer+KEYS_REPORT;
+        return NKRO_REPORT;
+      }
+      return KEYS_REPORT;
     }else if(rq->bRequest == USBRQ_HID_SET_REPORT){
-      if (rq->wLength.word == 1) { /* We expect one byte reports */
+      /* The LED report, after its report ID in report protocol */
+      if (rq->wLength.word == 1 || rq->wLength.word == 2) {
         expectReport=1;
         return 0xFF; /* Call usbFunctionWrite with data */
       }  
     }else if(rq->bRequest == USBRQ_HID_GET_IDLE){
-      usbMsgPtr = &idleRate;
+      usbMsgPtr = &idleRate[id == REPORT_ID_NKRO ? IDLE_NKRO : IDLE_KEYS];
       return 1;
-    }else if(rq->bRequest == USBRQ_HID_SET_IDLE){
-      idleRate = rq->wValue.bytes[1];
-    }else if(rq->bRequest == USBRQ_HID_GET_PROTOCOL) {
-      if (rq->wValue.bytes[1] < 1) {
-        protocolVer = rq->wValue.bytes[1];
+    }else if(rq->bRequest == USBRQ_HID_SET_IDLE){ /* ID 0 sets both */
+      if(id != REPORT_ID_NKRO){
+        idleRate[IDLE_KEYS] = rq->wValue.bytes[1];
+        idleReset(IDLE_KEYS);
       }
-    }else if(rq->bRequest == USBRQ_HID_SET_PROTOCOL) {
+      if(!id || id == REPORT_ID_NKRO){
+        idleRate[IDLE_NKRO] = rq->wValue.bytes[1];
+        idleReset(IDLE_NKRO);
+      }
+    }else if(rq->bRequest == USBRQ_HID_GET_PROTOCOL) {
       usbMsgPtr = &protocolVer;
       return 1;
+    }else if(rq->bRequest == USBRQ_HID_SET_PROTOCOL) {
+      if (rq->wValue.bytes[0] <= 1) { /* wValue: 0 is boot, 1 is report */
+        setProtocol(rq->wValue.bytes[0]);
+      }
     }
   }
   return 0;
 }
 
 uchar usbFunctionWrite(uchar *data, uchar len) {
-  if ((expectReport)&&(len==1)) {
-    //LEDstate=data[0]; /* Get the state of all 5 LEDs */
-    //if (LEDstate&LED_CAPS) { /* Check state of CAPS lock LED */
-    //  PORTD|=0x02;
-    //} else {
-    //  PORTD&=~0x02;
-    //}
+  if (expectReport==2) return keymapWrite(data,len);
+  if ((expectReport)&&(len>=1)&&(len<=2)) {
+    LEDstate=data[len-1]; /* Get the state of all 5 LEDs, shown by ledTask() */
     expectReport=0;
     return 1;
   }
@@ -393,12 +1819,217 @@ uchar usbFunctionWrite(uchar *data, uchar len) {
   return 0x01;
 }
 
+/* Drive the LED from the host LEDs, the activity flash and the blink
+   patterns. The LED is off while the bus is suspended. */
+static void ledTask(void) {
+  uchar on;
+
+  if (ledFlash) ledFlash--;
+  if (!ledRuns--) { /* Next step */
+    ledRuns=LED_STEP-1;
+    ledStep=(ledStep+1)&7;
+#if LED_DIAG
+    uchar row, quarantined=0;
+
+    for (row=0;row<SCANROWS;++row) quarantined|=quarantine[row];
+    ledBlink=!usbConfiguration?LED_FAST:quarantined?LED_SLOW:0;
+#endif
+  }
+  if (ledBlink) {
+    on=(ledBlink>>ledStep)&1;
+  } else {
+    on=(LEDstate&LED_SHOW)!=0;
+  }
+#if LED_ACTIVITY
+  if (ledFlash) on=!on;
+#endif
+  if (suspendFlag) on=0;
+  if (on!=ledOn) {
+    ledOn=on;
+    if (on) PORTD|=LED_PIN;
+    else PORTD&=~LED_PIN;
+  }
+}
+
+/* Suspend. The host keeps the bus busy with a keep-alive every ms
+   (counted in usbSofCount); MAX_SUSPEND_CNT without one means that the
+   bus is suspended. The MCU then sleeps whenever the scanner is in the
+   idle probe, the bus is in the idle state (not resuming or in reset)
+   and no wakeup is being signalled.
+   If the host allowed remote wakeup, the MCU sleeps in idle mode with
+   all rows still driven low by the probe, and timer 0 wakes it every
+   ~22 ms to read the columns; a key down goes back to the scanner, which
+   takes the key and wakes the host. Otherwise the rows are released and
+   the MCU sleeps in power-down, from which only a low level on INT0
+   (D-, i.e. bus activity) wakes it. The idle mode takes more than the USB
+   suspend current, but the ATmega8 has no interrupt on the column lines
+   that could wake it from power-down on a key press (see doc.txt). */
+EMPTY_INTERRUPT(TIMER0_OVF_vect);
+
+static void suspendTask(void) {
+  if (usbSofCount!=sofSeen) {
+    sofSeen=usbSofCount;
+    busStamp=sofStamp;
+    suspendFlag=0;
+    return;
+  }
+  if ((uchar)(TCNT0-busStamp)<MAX_SUSPEND_CNT) return;
+  busStamp=TCNT0; /* Look again after another MAX_SUSPEND_CNT */
+  if (!suspendFlag) stats.suspends++;
+  suspendFlag=1;
+  if (scanRow!=SCAN_PROBE || scanChanged || wakeupState==WAKEUP_K_STATE ||
+      !(USBIN&(1<<USBMINUS))) return;
+
+  ledTask(); /* LED off */
+  if (wakeupEnabled) {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    TIMSK|=1<<TOIE0;
+    while (usbSofCount==sofSeen && readCols()==0xFF && (USBIN&(1<<USBMINUS))) {
+      sleep_mode();
+      wdt_reset();
+#ifdef RESTORE_ROW
+      if (restoreEdge) break;
+#endif
+    }
+    TIMSK&=~(1<<TOIE0);
+  } else {
+    DDRB=0x00; /* Release the rows */
+    PORTB|=0x3F;
+    DDRD&=~ROWS_D;
+    PORTD|=ROWS_D;
+    wdt_disable();
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    USB_INTR_CFG&=~USB_INTR_CFG_SET; /* Edges do not wake from power-down */
+    sleep_mode();
+    USB_INTR_CFG|=USB_INTR_CFG_SET;
+    USB_INTR_PENDING=1<<USB_INTR_PENDING_BIT;
+    wdt_enable(WDTO_2S);
+    driveRow(ALLROWS);
+  }
+  busStamp=TCNT0;
+  loopStamp=busStamp; /* The sleep is no loop pass */
+}
+
+/* Scan the keyboard for changes, and queue the new report */
+static void scanTask(void) {
+  if (scankeys()) queueKeys(0);
+}
+
+/* Queue the current reports whose idle time is over, and send the
+   queued reports */
+static void sendTask(void) {
+  uchar due=0;
+
+  if (idleDue&(1<<IDLE_KEYS)) due=PART_KEYS;
+  if (protocolVer && (idleDue&(1<<IDLE_NKRO))) due|=PART_NKRO;
+  if (due && !queueLen) {
+    queueReport(due);
+  }
+  if (packetWaiting && usbInterruptIsReady()) { /* The host took a packet */
+    packetWaiting=0;
+    inStamp=TCNT0;
+    inSeen(packetStamp);
+  }
+  if (queueLen && usbInterruptIsReady()) {
+    sendReport();
+  }
+}
+
+/* Write the uploaded keymap to EEPROM, one byte whenever the EEPROM is
+   ready so the main loop never waits for it, and then the choice of the
+   keymap (eeWrite starts at sizeof(kmUser) for the choice alone).
+   Unchanged bytes are skipped by eeprom_update_byte(). */
+static void eeTask(void) {
+  if (eeWrite==0xFFFF || !eeprom_is_ready()) return;
+  if (eeWrite<sizeof(kmUser)) {
+    eeprom_update_byte((uint8_t *)&eeUser+eeWrite,((uchar *)&kmUser)[eeWrite]);
+    eeWrite++;
+  } else {
+    eeprom_update_byte(&kmSaved,kmIndex);
+    eeWrite=0xFFFF;
+  }
+}
+
+/* Take the scan rate of the last second */
+static void statsTask(void) {
+  stats.scanRate=statsFrames;
+  statsFrames=0;
+}
+
+/* Scheduler. Its only timebase is timer 1, counting in steps of 0.67 us:
+   1500 steps make the 1 ms tick, exactly. Every pass of the main loop runs
+   the tasks in the table in turn: those with a period of 0 on every pass,
+   the others once every period ticks. The longest run of every task goes
+   to the counters report (stats.taskWorst, in the order of the table), so
+   the share of each task in the time between two USB polls can be read
+   from the host. Ticks missed while the MCU sleeps are dropped, not caught
+   up. (Timer 0 stays with the scanner and the USB frame timing.) */
+#define TICK_TCNT (F_CPU/8/1000) /* Timer 1 steps per ms */
+
+typedef struct {
+  void (*run)(void);
+  uint16_t period; /* In ms, or 0 for every pass */
+} task_t;
+
+const task_t tasks[TASKS] PROGMEM = {
+  {usbPoll, 0},                    /* USB driver */
+  {scanTask, 0},                   /* One row of the matrix per pass */
+  {wakeupTask, 0},                 /* Remote wakeup */
+  {chatterWindow, CHATTER_WINDOW}, /* Re-admit quarantined keys */
+  {idleTask, 1},                   /* Idle report times */
+  {sendTask, 0},                   /* Keyboard endpoint */
+#ifdef JOYSTICK
+  {joyTask, 0},                    /* Sample the joysticks */
+#endif
+  {ctrlTask, 0},                   /* Control key endpoint */
+  {ledTask, LED_PERIOD},           /* Show the LEDs */
+  {eeTask, 0},                     /* Write an uploaded keymap */
+  {uploadTask, 1000},              /* Upload timeout */
+  {statsTask, 1000},               /* Scan rate */
+  {suspendTask, 0}                 /* Sleep while the bus is suspended */
+};
+
+static uint16_t taskWait[TASKS]; /* Ticks until the next run */
+static uint16_t tickStamp;       /* TCNT1 at the last tick */
+
+/* Return true if a tick is due */
+static uchar tickDue(void) {
+  if ((uint16_t)(TCNT1-tickStamp)<TICK_TCNT) return 0;
+  tickStamp+=TICK_TCNT;
+  if ((uint16_t)(TCNT1-tickStamp)>=8*TICK_TCNT) { /* Slept - drop the ticks */
+    tickStamp=TCNT1;
+  }
+  return 1;
+}
+
+static void runTasks(void) {
+  uchar i, tick=tickDue();
+  uint16_t t;
+  void (*run)(void);
+
+  for (i=0;i<TASKS;++i) {
+    if (pgm_read_word(&tasks[i].period)) {
+      if (!tick) continue;
+      if (taskWait[i] && --taskWait[i]) continue;
+      taskWait[i]=pgm_read_word(&tasks[i].period);
+    }
+    run=pgm_read_ptr(&tasks[i].run);
+    t=TCNT1;
+    run();
+    t=TCNT1-t;
+    if (t>stats.taskWorst[i] && !suspendFlag) stats.taskWorst[i]=t;
+  }
+}
+
 int main(void) {
-  uchar   updateNeeded = 0;
-  uchar   idleCounter = 0;
+  uchar   now;
 
   wdt_enable(WDTO_2S); /* Enable watchdog timer 2s */
   hardwareInit(); /* Initialize hardware (I/O) */
+  stuckKeyTest(); /* Quarantine keys that are stuck */
+  bootKeymap(); /* Choose the keymap */
+  startFrame(); /* Prepare the scanner */
+  buildReport(); /* No keys yet, but the report IDs in place */
   
   odDebugInit();
 
@@ -407,43 +2038,12 @@ int main(void) {
   
   for(;;){  /* Main loop */
     wdt_reset(); /* Reset the watchdog */
-    usbPoll(); /* Poll the USB stack */
-
-    updateNeeded|=scankeys(); /* Scan the keyboard for changes */
-    
-    /* Check timer if we need periodic reports */
-    if(TIFR & (1<<TOV0)){
-      TIFR = 1<<TOV0; /* Reset flag */
-      if(idleRate != 0){ /* Do we need periodic reports? */
-        if(idleCounter > 4){ /* Yes, but not yet */
-          idleCounter -= 5;   /* 22 ms in units of 4 ms */
-        }else{ /* Yes, it is time now */
-          updateNeeded = 1;
-          idleCounter = idleRate;
-        }
-      }
-    }
-
-
-    /* If an update is needed, send the report */
-    if(updateNeeded && usbInterruptIsReady()){
-      updateNeeded = 0;
-      usbSetInterrupt(reportBuffer, sizeof(reportBuffer));
+    now = TCNT0; /* Time the loop pass */
+    if((uchar)(now-loopStamp) > stats.worstLoop){
+      stats.worstLoop = now-loopStamp;
     }
-
-
-if(usbSofCount != 0) {
-usbSofCount = 0;
-suspendFlag = 0;
-standbyCounter = 0;
-//PORTD&=~0x02;
-} else {
-if (standbyCounter > 5) {
-suspendFlag = 1;
-//PORTD|=0x02;
-}
-}
-
+    loopStamp = now;
+    runTasks(); /* Poll the USB stack, scan the keyboard and the rest */
   }
   return 0;
 }
@@ -0,0 +1,501 @@
+/*********************************************************************
+ * keymapc.cpp - Keymap compiler (host tool)                         *
+ *********************************************************************
+ * Compiles a layout description (see c64_us_de.kmap and doc.txt)    *
+ * into the unshifted and shifted planes of a keymap header for      *
+ * include/keymaps, and/or into the keymap feature reports that are  *
+ * uploaded to the keyboard over USB.                                *
+ *                                                                   *
+ * Build: g++ -O2 -o keymapc keymapc.cpp                             *
+ * Usage: keymapc [-I include] [-o key_x.h] [-b keymap.bin] x.kmap   *
+ *********************************************************************
+ * Spaceman Spiff's Commodire 64 USB Keyboard (c64key for short) is  *
+ * is free software; you can redistribute it and/or modify it under  *
+ * the terms of the OBDEV license, as found in the licence.txt file. *
+ *                                                                   *
+ * c64key is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of    *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *
+ * OBDEV license for further details.                                *
+ *********************************************************************/
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Layout of the keymap feature reports (userkeymap_t in src/main.c) */
+#define REPORT_ID_KEYMAP  6 /* Unshifted plane */
+#define REPORT_ID_SHIFTED 7 /* Shifted plane and checksum */
+#define USER_ROWS         9
+
+/* Modifier changes of a special key. The GUI bits clear the shifts
+   (see buildReport() in src/main.c). */
+static const struct { const char *name; int bits; } modnames[] = {
+  { "+lctrl", 0x01 }, { "+lshift", 0x02 }, { "+lalt", 0x04 },
+  { "+rctrl", 0x10 }, { "+rshift", 0x20 }, { "+ralt", 0x40 },
+  { "-lshift", 0x08 }, { "-rshift", 0x80 }, { "-shift", 0x88 },
+};
+
+struct half {        /* One state of a special key */
+  string key;
+  int mods;
+  bool operator==(const half &o) const { return key==o.key && mods==o.mods; }
+};
+
+struct special {     /* A special key */
+  string name;
+  half plain, shifted;
+  int line;
+};
+
+struct fnkey {       /* A fn_keys entry */
+  int row, col;
+  string usage;
+  string comment;
+};
+
+static string src;                       /* Layout file name */
+static int errors;
+static map<string,int> keycodes;         /* enum keycodes, by name */
+static map<string,unsigned> usages;      /* CC_ and SC_ usages */
+
+static void error(int line, const char *fmt, const string &arg) {
+  fprintf(stderr, "%s:%d: error: ", src.c_str(), line);
+  fprintf(stderr, fmt, arg.c_str());
+  fputc('\n', stderr);
+  ++errors;
+}
+
+static void warning(int line, const char *fmt, const string &arg) {
+  fprintf(stderr, "%s:%d: warning: ", src.c_str(), line);
+  fprintf(stderr, fmt, arg.c_str());
+  fputc('\n', stderr);
+}
+
+static string readFile(const string &path) {
+  ifstream f(path.c_str(), ios::binary);
+  if (!f) {
+    fprintf(stderr, "keymapc: cannot read %s\n", path.c_str());
+    exit(1);
+  }
+  stringstream s;
+  s << f.rdbuf();
+  return s.str();
+}
+
+/* Remove comments of both kinds from C source */
+static string stripComments(const string &s) {
+  string out;
+  size_t i=0;
+
+  while (i<s.size()) {
+    if (!s.compare(i, 2, "/*")) {
+      size_t e=s.find("*/", i+2);
+      i=(e==string::npos)?s.size():e+2;
+      out+=' ';
+    } else if (!s.compare(i, 2, "//")) {
+      while (i<s.size() && s[i]!='\n') ++i;
+    } else {
+      out+=s[i++];
+    }
+  }
+  return out;
+}
+
+static string trim(const string &s) {
+  size_t b=s.find_first_not_of(" \t\r\n"), e=s.find_last_not_of(" \t\r\n");
+  return (b==string::npos)?string():s.substr(b, e-b+1);
+}
+
+/* Read the values of enum keycodes from keycodes.h */
+static void readKeycodes(const string &dir) {
+  string s=stripComments(readFile(dir+"/keycodes.h"));
+  size_t b=s.find("enum keycodes"), e;
+  int value=0;
+
+  if (b==string::npos || (b=s.find('{', b))==string::npos ||
+      (e=s.find('}', b))==string::npos) {
+    fprintf(stderr, "keymapc: no enum keycodes in %s/keycodes.h\n",
+            dir.c_str());
+    exit(1);
+  }
+  stringstream items(s.substr(b+1, e-b-1));
+  string item;
+  while (getline(items, item, ',')) {
+    size_t eq=item.find('=');
+    string name=trim(item.substr(0, eq));
+    if (name.empty()) continue;
+    if (eq!=string::npos) value=strtol(trim(item.substr(eq+1)).c_str(), 0, 0);
+    keycodes[name]=value++;
+  }
+}
+
+/* Read the CC_ and SC_ usages from hidusage.h */
+static void readUsages(const string &dir) {
+  stringstream s(stripComments(readFile(dir+"/hidusage.h")));
+  string line, def, name, value;
+
+  while (getline(s, line)) {
+    stringstream l(line);
+    if (!(l >> def >> name) || def!="#define") continue;
+    getline(l, value);
+    value=trim(value);
+    if (name.compare(0, 3, "CC_") && name.compare(0, 3, "SC_")) continue;
+    if (!value.compare(0, 13, "(SYSTEM_CTRL|")) {
+      usages[name]=0x8000|strtoul(value.c_str()+13, 0, 0);
+    } else {
+      usages[name]=strtoul(value.c_str(), 0, 0);
+    }
+  }
+}
+
+/* Return the keycode name for a key in a layout: a name from keycodes.h,
+   or one without its KEY_ prefix; - is no key */
+static string keyName(int line, const string &tok) {
+  if (tok=="-") return "KEY__";
+  if (keycodes.count(tok)) return tok;
+  if (keycodes.count("KEY_"+tok)) return "KEY_"+tok;
+  error(line, "unknown key %s", tok);
+  return "KEY__";
+}
+
+static int modBits(int line, const string &tok) {
+  for (size_t i=0; i<sizeof(modnames)/sizeof(modnames[0]); ++i) {
+    if (tok==modnames[i].name) return modnames[i].bits;
+  }
+  if (!tok.compare(0, 2, "0x")) return strtol(tok.c_str(), 0, 16)&0xFF;
+  error(line, "unknown modifier change %s", tok);
+  return 0;
+}
+
+/* The layout */
+static string name, title, machine;
+static vector<vector<string> > rows;
+static vector<string> rowComments;
+static vector<special> specs;
+static int fnRow=-1, fnCol=-1;
+static string fnComment;
+static vector<fnkey> fns;
+static vector<half> planes[2];           /* Unshifted and shifted plane */
+
+/* Parse "key [mods...]" of a special key */
+static half parseHalf(int line, const string &s) {
+  stringstream l(s);
+  string tok;
+  half h;
+
+  h.mods=0;
+  if (!(l >> tok)) {
+    error(line, "missing key%s", "");
+    return h;
+  }
+  h.key=keyName(line, tok);
+  while (l >> tok) h.mods|=modBits(line, tok);
+  return h;
+}
+
+static void parseLayout(void) {
+  stringstream s(readFile(src));
+  string text, word, comment;
+  int line=0;
+
+  while (getline(s, text)) {
+    ++line;
+    size_t hash=text.find('#');
+    comment=(hash==string::npos)?string():trim(text.substr(hash+1));
+    stringstream l(text.substr(0, hash));
+    if (!(l >> word)) continue;
+
+    if (word=="name") {
+      l >> name;
+    } else if (word=="title") {
+      getline(l, title);
+      title=trim(title);
+    } else if (word=="machine") {
+      l >> machine;
+      if (machine!="C64" && machine!="C16" && machine!="PLUS4") {
+        error(line, "machine must be C64, C16 or PLUS4, not %s", machine);
+      }
+    } else if (word=="row") {
+      vector<string> row;
+      string tok;
+      while (l >> tok) row.push_back(keyName(line, tok));
+      if (row.size()!=8) error(line, "a row needs 8 keys%s", "");
+      row.resize(8, "KEY__");
+      rows.push_back(row);
+      rowComments.push_back(comment);
+    } else if (word=="special") {
+      special sp;
+      string rest;
+      l >> sp.name;
+      getline(l, rest);
+      size_t slash=rest.find('/');
+      if (sp.name.compare(0, 4, "SPC_") || !keycodes.count(sp.name)) {
+        error(line, "unknown special key %s", sp.name);
+      }
+      if (slash==string::npos) {
+        error(line, "%s needs an unshifted and a shifted half (a / b)",
+              sp.name);
+        continue;
+      }
+      sp.plain=parseHalf(line, rest.substr(0, slash));
+      sp.shifted=parseHalf(line, rest.substr(slash+1));
+      sp.line=line;
+      specs.push_back(sp);
+    } else if (word=="fnkey") {
+      l >> fnRow >> fnCol;
+      fnComment=comment;
+    } else if (word=="fn") {
+      fnkey f;
+      l >> f.row >> f.col >> f.usage;
+      if (!usages.count(f.usage) && f.usage.compare(0, 2, "0x")) {
+        error(line, "unknown usage %s", f.usage);
+      }
+      f.comment=comment;
+      fns.push_back(f);
+    } else {
+      error(line, "unknown keyword %s", word);
+    }
+  }
+  if (name.empty()) error(line, "no name%s", "");
+  if (machine.empty()) error(line, "no machine%s", "");
+  if (rows.empty()) error(line, "no rows%s", "");
+  if (!fns.empty() && fnRow<0) error(line, "fn keys without fnkey%s", "");
+}
+
+/* Check the special keys and fill in the planes: a plain key is the same
+   in both, a special key has its halves */
+static void buildPlanes(void) {
+  map<string,size_t> byName;
+  set<string> used;
+  size_t i, j;
+
+  for (i=0; i<specs.size(); ++i) {
+    special &sp=specs[i];
+    if (byName.count(sp.name)) {
+      special &first=specs[byName[sp.name]];
+      if (first.plain==sp.plain && first.shifted==sp.shifted) {
+        warning(sp.line, "%s repeated", sp.name);
+      } else {
+        error(sp.line, "%s defined twice, differently", sp.name);
+      }
+      continue;
+    }
+    byName[sp.name]=i;
+  }
+
+  for (i=0; i<rows.size(); ++i) {
+    for (j=0; j<8; ++j) {
+      const string &key=rows[i][j];
+      half h={ key, 0 };
+      if (!key.compare(0, 4, "SPC_")) {
+        if (byName.count(key)) {
+          planes[0].push_back(specs[byName[key]].plain);
+          planes[1].push_back(specs[byName[key]].shifted);
+          used.insert(key);
+          continue;
+        }
+        error(0, "%s is used in the keymap but has no special entry", key);
+      }
+      planes[0].push_back(h);
+      planes[1].push_back(h);
+    }
+  }
+
+  for (i=0; i<specs.size(); ++i) {
+    if (!used.count(specs[i].name)) {
+      warning(specs[i].line, "%s is not used in the keymap", specs[i].name);
+      used.insert(specs[i].name); /* Say it once */
+    }
+  }
+}
+
+static string upper(string s) {
+  for (size_t i=0; i<s.size(); ++i) s[i]=toupper((unsigned char)s[i]);
+  return s;
+}
+
+static string hex(int v) {
+  char buf[8];
+  snprintf(buf, sizeof(buf), "0x%02X", v);
+  return buf;
+}
+
+static string pad(const string &s, size_t n) {
+  return s.size()<n?s+string(n-s.size(), ' '):s;
+}
+
+/* Write the header, in the format of the other keymaps (CRLF) */
+static void writeHeader(const string &path) {
+  string file="key_"+name+".h", guard="KEY_"+upper(name)+"_H";
+  string text=file+" - "+title, h;
+  size_t i, j, p, cut;
+
+  h="/*********************************************************************\n";
+  while (!text.empty()) { /* Word wrap into the box */
+    cut=text.size();
+    if (cut>65) {
+      cut=text.rfind(' ', 65);
+      if (cut==string::npos || !cut) cut=65;
+    }
+    h+=" * "+pad(text.substr(0, cut), 66)+"*\n";
+    text=trim(text.substr(cut));
+  }
+  h+=" * "+pad("Generated by tools/keymapc from "+src, 66)+"*\n";
+  h+=
+    " *********************************************************************\n"
+    " * Spaceman Spiff's Commodire 64 USB Keyboard (c64key for short) is  *\n"
+    " * is free software; you can redistribute it and/or modify it under  *\n"
+    " * the terms of the OBDEV license, as found in the licence.txt file. *\n"
+    " *                                                                   *\n"
+    " * c64key is distributed in the hope that it will be useful,         *\n"
+    " * but WITHOUT ANY WARRANTY; without even the implied warranty of    *\n"
+    " * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the     *\n"
+    " * OBDEV license for further details.                                *\n"
+    " *********************************************************************/\n";
+  h+="#ifndef "+guard+"\n#define "+guard+"\n";
+  h+="#include <avr/pgmspace.h>\n#include \"hidusage.h\"\n#include \"keycodes.h\"\n\n";
+  h+="#define "+machine+"\n\n";
+  h+="/* Number of rows in keyboard matrix */\n";
+  h+="#define NUMROWS "+to_string(rows.size())+"\n\n";
+  h+="/* The keycode and the modifier changes of every key, in the unshifted\n"
+     "   and the shifted plane (the latter is used while a shift key is held).\n"
+     "   Since the LGUI and RGUI bits are not used, these signify that the\n"
+     "   left and right shift states should be deleted from report, so\n"
+     "     0x88 means clear both shift flags\n"
+     "     0x00 means do not alter shift states\n"
+     "     0xC8 means clear both shifts and set R_ALT */\n";
+  h+="const unsigned char keymap_"+name+"[2][NUMROWS][8][2] PROGMEM = {\n";
+  for (p=0; p<2; ++p) {
+    h+=p?"  { // Shifted\n":"  { // Unshifted\n";
+    for (i=0; i<rows.size(); ++i) {
+      h+="    {";
+      for (j=0; j<8; ++j) {
+        const half &k=planes[p][i*8+j];
+        h+="{"+((k.key=="KEY__")?string("0"):k.key)+","+
+           (k.mods?hex(k.mods):string("0"))+"}";
+        if (j<7) h+=", ";
+      }
+      h+=(i+1<rows.size())?"}, // ":"} // ";
+      h+=rowComments[i].empty()?"row"+to_string(i):rowComments[i];
+      h+="\n";
+    }
+    h+=p?"  }\n":"  },\n";
+  }
+  h+="};\n\n";
+
+  h+="/* Consumer and system control keys. These are sent on their own interface\n"
+     "   when the key is pressed together with FN_KEY (C=); each entry holds the\n"
+     "   matrix position of the key and the usage (see hidusage.h). */\n";
+  h+="#define FN_KEY FNPOS("+to_string(fnRow)+","+to_string(fnCol)+")";
+  if (!fnComment.empty()) h+=" /* "+fnComment+" */";
+  h+="\n";
+  h+="const unsigned int fn_keys_"+name+"["+to_string(fns.size())+
+     "][2] PROGMEM = {\n";
+  for (i=0; i<fns.size(); ++i) {
+    const fnkey &f=fns[i];
+    h+="  { FNPOS("+to_string(f.row)+","+to_string(f.col)+"), "+
+       pad(f.usage, 11)+"},";
+    if (!f.comment.empty()) h+=" // "+f.comment;
+    h+="\n";
+  }
+  h+="};\n#endif\n";
+
+  string crlf;
+  for (i=0; i<h.size(); ++i) {
+    if (h[i]=='\n') crlf+='\r';
+    crlf+=h[i];
+  }
+  ofstream f(path.c_str(), ios::binary);
+  f << crlf;
+  if (!f) {
+    fprintf(stderr, "keymapc: cannot write %s\n", path.c_str());
+    exit(1);
+  }
+}
+
+/* CRC-16 as computed by _crc16_update() of avr-libc */
+static unsigned crc16(unsigned crc, unsigned char a) {
+  int i;
+
+  crc^=a;
+  for (i=0; i<8; ++i) crc=(crc&1)?(crc>>1)^0xA001:crc>>1;
+  return crc;
+}
+
+/* Write the keymap feature reports (report ID and data, for SET_REPORT):
+   the unshifted plane, then the shifted plane and the checksum of both */
+static void writeReport(const string &path) {
+  vector<unsigned char> r;
+  size_t i, p;
+  unsigned sum=0xFFFF;
+
+  if (rows.size()!=USER_ROWS) {
+    error(0, "the keymap report needs %s rows", to_string(USER_ROWS));
+    return;
+  }
+  for (p=0; p<2; ++p) {
+    r.push_back(p?REPORT_ID_SHIFTED:REPORT_ID_KEYMAP);
+    for (i=0; i<planes[p].size(); ++i) {
+      r.push_back(keycodes[planes[p][i].key]);
+      r.push_back(planes[p][i].mods);
+      sum=crc16(sum, r[r.size()-2]);
+      sum=crc16(sum, r[r.size()-1]);
+    }
+  }
+  r.push_back(sum&0xFF);
+  r.push_back(sum>>8);
+
+  ofstream f(path.c_str(), ios::binary);
+  f.write((const char *)&r[0], r.size());
+  if (!f) {
+    fprintf(stderr, "keymapc: cannot write %s\n", path.c_str());
+    exit(1);
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "usage: keymapc [-I include] [-o key_x.h] [-b keymap.bin] x.kmap\n"
+    "  -I dir   directory with keycodes.h and hidusage.h (default include)\n"
+    "  -o file  write the keymap header\n"
+    "  -b file  write the keymap feature reports for upload over USB\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  string dir="include", header, report;
+  int i;
+
+  for (i=1; i<argc; ++i) {
+    if (!strcmp(argv[i], "-I") && i+1<argc) {
+      dir=argv[++i];
+    } else if (!strcmp(argv[i], "-o") && i+1<argc) {
+      header=argv[++i];
+    } else if (!strcmp(argv[i], "-b") && i+1<argc) {
+      report=argv[++i];
+    } else if (argv[i][0]=='-' || !src.empty()) {
+      usage();
+    } else {
+      src=argv[i];
+    }
+  }
+  if (src.empty()) usage();
+
+  readKeycodes(dir);
+  readUsages(dir);
+  parseLayout();
+  buildPlanes();
+  if (!errors && !header.empty()) writeHeader(header);
+  if (!errors && !report.empty()) writeReport(report);
+  return errors?1:0;
+}